@@ -0,0 +1,162 @@
+# Copyright (C) 2023 Zubax Robotics
+"""
+Benchmarks of the client hot paths. These are not collected by the regular test session;
+run them with ``nox -s benchmark``, which fails if a benchmark slows down past the threshold
+relative to the stored baseline.
+"""
+
+from __future__ import annotations
+
+import random
+import struct
+import numpy as np
+import pytest
+
+from typing import Any
+
+from serial_interface import Packet, CRC16CCITTFalse
+from force_sensor_interface import ForceSensorInterface, ForceSensorReading, MovingAverage
+from flight_recorder import FlightRecorder, EventCode
+from peak_estimation import estimate_peak
+from cycle_metrics import compute_cycle_metrics
+from latency_profile import LatencyHistogram
+from downsampling import lttb_indices
+
+FRAME_COUNT = 1000
+"""Number of frames in the synthetic streams; about 2.3 s of traffic at 38400 baud."""
+
+
+def _reading_frame(seq_num: int) -> bytes:
+    adc = struct.pack("< 4l", 261069056 + seq_num, 73710592 - seq_num, 0, 0)
+    cal = np.array([[0.0, 0.0], [1e-6, -1e-6]], dtype=np.float32).tobytes().ljust(40, b"\xff")
+    payload = struct.pack("< Q 8x 8x", seq_num) + adc + cal
+    return Packet(memoryview(payload)).compile()
+
+
+def _parse_all(stream: bytes) -> int:
+    data: memoryview | bytes = stream
+    count = 0
+    while True:
+        data, pkt = Packet.parse(data)
+        if pkt is None:
+            return count
+        count += 1
+
+
+@pytest.fixture(scope="module")
+def clean_stream() -> bytes:
+    return b"".join(_reading_frame(i) for i in range(FRAME_COUNT))
+
+
+@pytest.fixture(scope="module")
+def noisy_stream() -> bytes:
+    """Line noise between the frames and every tenth frame damaged, as seen with a bad cable."""
+    rng = random.Random(42)
+    out = bytearray()
+    for i in range(FRAME_COUNT):
+        out += rng.randbytes(rng.randint(0, 16))
+        frame = bytearray(_reading_frame(i))
+        if i % 10 == 0:
+            frame[rng.randrange(8, len(frame))] ^= 0x55
+        out += frame
+    return bytes(out)
+
+
+@pytest.fixture(scope="module")
+def pull_trace() -> tuple[np.ndarray, np.ndarray]:
+    """A typical pull: slack, loading ramp, detachment; 10 Hz for 30 s."""
+    rng = np.random.default_rng(42)
+    t = np.arange(0, 30, 0.1)
+    f = np.where(t < 5, 0.0, 0.8 * (t - 5))
+    f = np.where(t < 20.03, f, 0.2) + rng.normal(0, 0.02, len(t))
+    return t, f
+
+
+def test_packet_parse_clean(benchmark: Any, clean_stream: bytes) -> None:
+    benchmark.extra_info["bytes"] = len(clean_stream)
+    assert benchmark(_parse_all, clean_stream) == FRAME_COUNT
+
+
+def test_packet_parse_noisy(benchmark: Any, noisy_stream: bytes) -> None:
+    benchmark.extra_info["bytes"] = len(noisy_stream)
+    assert benchmark(_parse_all, noisy_stream) >= FRAME_COUNT * 9 // 10
+
+
+def test_crc_add(benchmark: Any, clean_stream: bytes) -> None:
+    benchmark.extra_info["bytes"] = len(clean_stream)
+    benchmark(lambda: CRC16CCITTFalse().add(clean_stream))
+
+
+def test_packet_compile(benchmark: Any) -> None:
+    pkt = Packet(memoryview(bytes(80)))
+    buf = bytearray(pkt.compiled_size * FRAME_COUNT)
+
+    def run() -> None:
+        offset = 0
+        for _ in range(FRAME_COUNT):
+            offset += pkt.compile_into(buf, offset)
+
+    benchmark(run)
+
+
+def test_frame_decode(benchmark: Any) -> None:
+    _, pkt = Packet.parse(_reading_frame(7))
+    assert pkt is not None
+    seq_num, adc, cal = benchmark(ForceSensorInterface.decode, pkt.payload)
+    assert seq_num == 7 and adc.shape == (2,) and cal.shape == (2, 2)
+
+
+def test_compute_forces(benchmark: Any) -> None:
+    _, pkt = Packet.parse(_reading_frame(7))
+    assert pkt is not None
+    seq_num, adc, cal = ForceSensorInterface.decode(pkt.payload)
+    rd = ForceSensorReading(seq_num=seq_num, adc_readings=adc, calibration=cal)
+    assert benchmark(ForceSensorInterface.compute_forces, rd).shape == (2,)
+
+
+def test_moving_average(benchmark: Any) -> None:
+    ma = MovingAverage(8, np.zeros(2))
+    x = np.array([1.0, -1.0])
+
+    def run() -> None:
+        for _ in range(FRAME_COUNT):
+            ma(x)
+
+    benchmark(run)
+
+
+def test_flight_recorder(benchmark: Any) -> None:
+    fr = FlightRecorder(capacity=4096)
+
+    def run() -> None:
+        for i in range(FRAME_COUNT):
+            fr.record(EventCode.READING, i, 0.0)
+
+    benchmark(run)
+
+
+def test_latency_histogram(benchmark: Any) -> None:
+    h = LatencyHistogram()
+    rng = random.Random(42)
+    values = [rng.randint(10_000, 50_000_000) for _ in range(FRAME_COUNT)]
+
+    def run() -> None:
+        for v in values:
+            h.record(v)
+
+    benchmark(run)
+
+
+def test_estimate_peak(benchmark: Any, pull_trace: tuple[np.ndarray, np.ndarray]) -> None:
+    assert benchmark(estimate_peak, *pull_trace).detached
+
+
+def test_compute_cycle_metrics(benchmark: Any, pull_trace: tuple[np.ndarray, np.ndarray]) -> None:
+    assert benchmark(compute_cycle_metrics, *pull_trace).detach_time is not None
+
+
+def test_lttb_overnight(benchmark: Any) -> None:
+    """Eight hours at 80 Hz to the points of a result plot; the cost must not grow with the length."""
+    t = np.arange(8 * 3600 * 80) / 80.0
+    f = 5 * np.sin(t / 60) + np.random.default_rng(42).normal(0, 0.05, len(t))
+    assert len(benchmark(lttb_indices, t, f, 2000)) <= 2002
@@ -0,0 +1,61 @@
+# Copyright (C) 2023 Zubax Robotics
+"""
+Wall-clock timing bounds of the client against the simulated devices. They depend on the load of the host,
+so they are kept out of the doctests, which only check the structure of the results;
+``nox -s benchmark`` runs them before the hot path benchmarks.
+"""
+
+from __future__ import annotations
+
+import asyncio
+
+from serial_interface import IOManager
+from frame_generator import FORCE_FRAME_SIZE, run_stress
+from reaction_benchmark import ClientConfig, SimulatedDevices, run_reaction_benchmark
+from step_drive_control import StepDriveControl
+from jog import run_jog
+
+
+def test_reaction_detection_latency() -> None:
+    """The crossing is detected within two frames plus scheduling slack of the step, and before the stop."""
+    r = asyncio.run(run_reaction_benchmark(ClientConfig(True, "ack"), trials=3, lead=0.2, report_period=0.02))
+    assert r.missed == 0
+    frame_ms = FORCE_FRAME_SIZE * 10 / IOManager.BAUD * 1e3
+    det, stop = (r.histograms[s] for s in ("detection", "stop"))
+    assert frame_ms < det.min * 1e-6 < det.max * 1e-6 < 2 * frame_ms + 20
+    assert det.min < stop.min
+
+
+def test_jog_hold_duration() -> None:
+    """A key held for half a second moves the drive about as long, and the readout agrees with the drive."""
+    dev = SimulatedDevices(report_period=0.01)
+    dev.start()
+
+    async def operator(keys: asyncio.Queue[str]) -> None:
+        for _ in range(10):
+            keys.put_nowait("down")
+            await asyncio.sleep(0.05)
+        await asyncio.sleep(0.3)
+        keys.put_nowait("quit")
+
+    async def run() -> float:
+        drive = StepDriveControl(dev.drive_link.port, event_driven=True, confirm="ack")  # type: ignore[arg-type]
+        keys: asyncio.Queue[str] = asyncio.Queue()
+        _, state = await asyncio.gather(operator(keys), run_jog(drive, keys))
+        drive.close()
+        return state.position
+
+    try:
+        position = asyncio.run(run())
+    finally:
+        dev.stop()
+    moved = dev.commands[1][0] - dev.commands[0][0]
+    assert 0.5 < moved < 0.65
+    assert abs(position - moved) < 0.03
+
+
+def test_batched_frames_wait() -> None:
+    """A frame written in a batch waits for the rest of it, so the median latency grows with the batch."""
+    r = asyncio.run(run_stress(baud=384_000, duration=0.3))
+    b = asyncio.run(run_stress(baud=384_000, duration=0.3, batch=8))
+    assert b.latency.percentile(50) > r.latency.percentile(50)
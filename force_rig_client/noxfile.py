@@ -5,6 +5,7 @@ import shutil
 from pathlib import Path
 import nox
 import os
+import platform
 
 
 PYTHONS = ["3.12"]
@@ -14,6 +15,7 @@ nox.options.error_on_external_run = True
 PROJECT_ROOT = Path(__file__).parent.resolve()
 LIB_DIR = PROJECT_ROOT / "lib"
 DSDL_DIR = PROJECT_ROOT / "dsdl_types"
+BENCHMARK_BASELINE = "baseline"
 
 
 @nox.session(python=False)
@@ -83,6 +85,44 @@ def test(session):
     # session.run("pylint", "src")
 
 
+@nox.session(python=PYTHONS)
+def benchmark(session):
+    """
+    Runs the benchmarks of the client hot paths and compares them against the baseline of this host and interpreter
+    stored in .benchmarks/<hostname>/.
+    Fails if any benchmark is slower than the baseline by more than BENCHMARK_FAIL_THRESHOLD (min:10% by default;
+    the minimum is the least noisy statistic). The compared runs are not stored, so a slow run never becomes
+    the reference of the next one; the baseline only changes when it is stored explicitly, e.g., after an
+    intentional slowdown: nox -s benchmark -- rebase. The first run on a host stores the baseline.
+    """
+    session.install("-r", "requirements.txt")
+    session.install(
+        "pytest             ~= 7.3",
+        "pytest-benchmark   ~= 4.0",
+    )
+    session.run("pytest", "benchmarks/test_timing.py")  # Plain pass/fail bounds; --benchmark-only would skip them.
+    threshold = os.environ.get("BENCHMARK_FAIL_THRESHOLD", "min:10%")
+    # The machine id of pytest-benchmark only tells the OS and the interpreter apart, not the hosts.
+    storage = PROJECT_ROOT / ".benchmarks" / platform.node()
+    machine_id = session.run(
+        "python", "-c", "from pytest_benchmark.utils import get_machine_id; print(get_machine_id())", silent=True
+    ).strip()
+    args = [
+        "pytest",
+        "benchmarks",
+        "--benchmark-only",
+        "--benchmark-columns=min,median,ops",
+        f"--benchmark-storage={storage}",
+    ]
+    # Every rebase adds a numbered file; the latest one is the baseline.
+    baselines = sorted((storage / machine_id).glob(f"*_{BENCHMARK_BASELINE}.json"))
+    if baselines and "rebase" not in session.posargs:
+        args += [f"--benchmark-compare={baselines[-1]}", f"--benchmark-compare-fail={threshold}"]
+    else:
+        args += [f"--benchmark-save={BENCHMARK_BASELINE}"]
+    session.run(*args)
+
+
 @nox.session(reuse_venv=True)
 def black(session):
     session.install("black ~= 23.3")
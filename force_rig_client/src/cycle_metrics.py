@@ -0,0 +1,108 @@
+from __future__ import annotations
+
+import dataclasses
+import numpy as np
+from numpy.typing import ArrayLike
+
+from peak_estimation import PeakEstimate, estimate_peak
+
+
+@dataclasses.dataclass(frozen=True)
+class CycleMetrics:
+    """
+    Quantities derived from the force trace of one pull. Times are in the units of the timestamps.
+    """
+
+    peak: PeakEstimate
+    onset_time: float | None
+    """When the force first exceeded the onset threshold, i.e., the pull started loading the plate."""
+    time_to_peak: float
+    """From the onset (or the start of the trace if there is no onset) to the estimated peak."""
+    detach_time: float | None
+    """Time of the last sample before the first drop larger than the detachment threshold."""
+    pre_detach_slope: float
+    """Least-squares slope of the force just before the detachment (or the peak) [N/time unit]."""
+    impulse: float
+    """Integral of the force from the onset to the detachment (or the end of the trace) [N*time unit]."""
+    noise: float
+    """Robust estimate of the per-sample noise standard deviation [N]."""
+
+    def as_dict(self) -> dict[str, float | None]:
+        out: dict[str, float | None] = {
+            "peak": self.peak.force,
+            "peak_sigma": self.peak.sigma,
+            "peak_sampled": self.peak.sampled,
+        }
+        out.update({k: v for k, v in dataclasses.asdict(self).items() if k != "peak"})
+        return out
+
+
+def compute_cycle_metrics(
+    t: ArrayLike,
+    f: ArrayLike,
+    detach_threshold: float = 0.5,
+    onset_threshold: float = 0.3,
+    slope_window: int = 5,
+) -> CycleMetrics:
+    """
+    Computes all metrics of the pull from the whole trace at once, so that the acquisition loop only has to
+    collect the samples. The same function is used at the end of a live cycle and on archived traces.
+
+    >>> t = np.arange(0, 3, 0.1)
+    >>> f = np.where(t < 0.5, 0.0, 4 * (t - 0.5))
+    >>> f = np.where(t < 2.02, f, 0.1)
+    >>> m = compute_cycle_metrics(t, f)
+    >>> round(m.onset_time, 3), round(m.detach_time, 3), round(m.pre_detach_slope, 3), round(m.noise, 3)
+    (0.6, 2.0, 4.0, 0.0)
+    >>> round(m.peak.force, 3), round(m.time_to_peak, 3), round(m.impulse, 3)
+    (6.2, 1.45, 4.48)
+    >>> sorted(m.as_dict())  # doctest: +NORMALIZE_WHITESPACE
+    ['detach_time', 'impulse', 'noise', 'onset_time', 'peak', 'peak_sampled', 'peak_sigma', 'pre_detach_slope',
+     'time_to_peak']
+
+    A trace where nothing happens:
+
+    >>> m = compute_cycle_metrics([0, 1, 2], [0, 0, 0])
+    >>> m.onset_time, m.detach_time, m.impulse
+    (None, None, 0.0)
+    """
+    t = np.asarray(t, dtype=np.float64)
+    f = np.asarray(f, dtype=np.float64)
+    peak = estimate_peak(t, f, cliff=_cliff_fraction(f, detach_threshold))
+    df = np.diff(f)
+
+    above = np.flatnonzero(f > onset_threshold)
+    onset = int(above[0]) if len(above) else None
+    drops = np.flatnonzero(-df > detach_threshold)
+    drops = drops[drops >= onset] if onset is not None else drops[:0]
+    detach = int(drops[0]) if len(drops) else None
+
+    start = onset if onset is not None else 0
+    end = detach if detach is not None else int(np.argmax(f))
+    seg_lo = max(start, end - slope_window + 1)
+    if end - seg_lo >= 1:
+        slope = float(np.polyfit(t[seg_lo : end + 1], f[seg_lo : end + 1], 1)[0])
+    else:
+        slope = 0.0
+
+    stop = (detach if detach is not None else len(f) - 1) + 1
+    impulse = float(np.trapz(f[start:stop], t[start:stop])) if onset is not None else 0.0
+
+    # The median absolute deviation of the first differences is insensitive to the ramps and the detachment step.
+    noise = float(1.4826 * np.median(np.abs(df - np.median(df))) / np.sqrt(2)) if len(df) else 0.0
+
+    return CycleMetrics(
+        peak=peak,
+        onset_time=float(t[onset]) if onset is not None else None,
+        time_to_peak=peak.time - float(t[start]),
+        detach_time=float(t[detach]) if detach is not None else None,
+        pre_detach_slope=slope,
+        impulse=impulse,
+        noise=noise,
+    )
+
+
+def _cliff_fraction(f: np.ndarray, detach_threshold: float) -> float:
+    """Expresses the absolute detachment threshold as the fraction of the peak used by the peak estimator."""
+    top = float(np.max(np.abs(f)))
+    return min(1.0, detach_threshold / top) if top > 0 else 1.0
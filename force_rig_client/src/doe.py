@@ -0,0 +1,224 @@
+from __future__ import annotations
+
+import os
+import json
+import logging
+import itertools
+import dataclasses
+import numpy as np
+
+from pathlib import Path
+from typing import Any, Literal, Sequence
+from scipy.stats import qmc
+
+_logger = logging.getLogger(__name__)
+
+Design = Literal["grid", "lhs", "sobol"]
+DESIGNS: tuple[Design, ...] = ("grid", "lhs", "sobol")
+
+
+@dataclasses.dataclass(frozen=True)
+class Factor:
+    """
+    One demag value varied by a sweep: its index in the demag vector and its inclusive integer range.
+    The grid takes ``levels`` evenly spaced values of the range, or every value if not given.
+
+    >>> f = Factor.parse("25:-50:50:5")
+    >>> f, f.grid_values()
+    (Factor(index=25, low=-50, high=50, levels=5), [-50, -25, 0, 25, 50])
+    >>> Factor.parse("3:0:2").grid_values()
+    [0, 1, 2]
+    >>> Factor(0, 0, 9).from_unit(np.array([0.0, 0.05, 0.5, 0.999])).tolist()  # Each value gets an equal share.
+    [0, 0, 5, 9]
+    """
+
+    index: int
+    low: int
+    high: int
+    levels: int | None = None
+
+    def __post_init__(self) -> None:
+        if self.low > self.high:
+            raise ValueError(f"Empty range of factor {self.index}: {self.low} > {self.high}")
+        if self.levels is not None and self.levels < 1:
+            raise ValueError(f"Factor {self.index} needs at least one level")
+
+    @staticmethod
+    def parse(spec: str) -> Factor:
+        """From INDEX:LOW:HIGH[:LEVELS]."""
+        parts = [int(p) for p in spec.split(":")]
+        if len(parts) not in (3, 4):
+            raise ValueError(f"Expected INDEX:LOW:HIGH[:LEVELS], got {spec!r}")
+        return Factor(*parts)
+
+    def grid_values(self) -> list[int]:
+        if self.levels is None:
+            return list(range(self.low, self.high + 1))
+        return sorted({int(round(v)) for v in np.linspace(self.low, self.high, self.levels)})
+
+    def from_unit(self, u: np.ndarray) -> np.ndarray:
+        """Maps [0, 1) onto the integers of the range, so that the strata of a space-filling design carry over."""
+        span = self.high - self.low + 1
+        return np.minimum(self.low + np.floor(u * span), self.high).astype(int)
+
+
+def make_design(design: Design, factors: Sequence[Factor], points: int = 16, seed: int = 0) -> list[tuple[int, ...]]:
+    """
+    The factor values of each trial of the design: the full grid, or ``points`` of a Latin hypercube
+    or of a scrambled Sobol' sequence (a power of two, which keeps its balance). The duplicates that the integer
+    ranges may produce are dropped, as measuring them again would only repeat a trial.
+
+    >>> fs = [Factor(0, 0, 1), Factor(5, -10, 10, 3)]
+    >>> make_design("grid", fs)
+    [(0, -10), (0, 0), (0, 10), (1, -10), (1, 0), (1, 10)]
+    >>> lhs = make_design("lhs", [Factor(0, 0, 7), Factor(1, 0, 7)], points=8)
+    >>> sorted(p[0] for p in lhs) == sorted(p[1] for p in lhs) == list(range(8))  # One trial per row and column.
+    True
+    >>> len(make_design("sobol", [Factor(0, -50, 50), Factor(1, -50, 50)], points=16))
+    16
+    >>> make_design("sobol", fs, points=12)
+    Traceback (most recent call last):
+    ...
+    ValueError: The Sobol' design needs a power of two points, got 12
+    """
+    if not factors:
+        raise ValueError("The design needs at least one factor")
+    if len({f.index for f in factors}) != len(factors):
+        raise ValueError("Each demag value can only be one factor")
+    if design == "grid":
+        return list(itertools.product(*(f.grid_values() for f in factors)))
+    if points < 1:
+        raise ValueError(f"The design needs at least one point, got {points}")
+    if design == "lhs":
+        unit = qmc.LatinHypercube(len(factors), seed=seed).random(points)
+    elif design == "sobol":
+        if points & (points - 1):
+            raise ValueError(f"The Sobol' design needs a power of two points, got {points}")
+        unit = qmc.Sobol(len(factors), scramble=True, seed=seed).random(points)
+    else:
+        raise ValueError(f"Unknown design {design!r}")
+    columns = [f.from_unit(unit[:, i]) for i, f in enumerate(factors)]
+    return list(dict.fromkeys(tuple(int(v) for v in row) for row in zip(*columns)))
+
+
+class SweepCheckpoint:
+    """
+    A design-of-experiments sweep over the demag vectors that differ from ``base`` in the factors, with the result
+    of every completed trial. It is saved after each trial (atomically, so an interruption never leaves it torn),
+    and reopening it resumes the sweep: the completed trials are skipped.
+
+    A change of the demag values makes the FluxGrip write its register and reboot, which takes seconds; whatever
+    the order, each distinct vector costs one, so :meth:`pending` runs the vector the magnet is already configured
+    with first and the rest in the order of the design.
+
+    >>> import tempfile
+    >>> tmp = tempfile.TemporaryDirectory()
+    >>> path = Path(tmp.name) / "sweep.json"
+    >>> base = [0] * 4
+    >>> sw = SweepCheckpoint.open(path, base, [Factor(1, 0, 2)], "grid")
+    >>> sw.points
+    [[0, 0, 0, 0], [0, 1, 0, 0], [0, 2, 0, 0]]
+    >>> sw.pending(current=[0, 2, 0, 0])
+    [2, 0, 1]
+    >>> sw.record(2, peak=4.5)
+    >>> sw.record(0, aborted=16.2)
+
+    Interrupted here; reopening with the same sweep resumes it, with another sweep is refused:
+
+    >>> sw = SweepCheckpoint.open(path, base, [Factor(1, 0, 2)], "grid")
+    >>> sw.pending(current=None), sw.done
+    ([1], 2)
+    >>> sw.record(1, peak=3.0)
+    >>> print(sw.report())  # doctest: +NORMALIZE_WHITESPACE
+    Sweep grid over factors 1: 3 of 3 trials done, 1 aborted
+    F_peak [N]  values
+          3.00  1
+          4.50  2
+       aborted  0 (16.2 N)
+    >>> SweepCheckpoint.open(path, base, [Factor(1, 0, 3)], "grid")
+    Traceback (most recent call last):
+    ...
+    ValueError: ... holds another sweep; choose another checkpoint file or the same design
+    >>> tmp.cleanup()
+    """
+
+    def __init__(self, path: Path, spec: dict[str, Any], points: list[list[int]]) -> None:
+        self._path = path
+        self._spec = spec
+        self.points = points
+        """The full demag vector of every trial, in the order of the design."""
+        self.results: dict[int, dict[str, float]] = {}
+        """By the index of the point: {"peak": F} or {"aborted": F}."""
+
+    @staticmethod
+    def open(
+        path: Path,
+        base: Sequence[int],
+        factors: Sequence[Factor],
+        design: Design,
+        points: int = 16,
+        seed: int = 0,
+    ) -> SweepCheckpoint:
+        spec = {
+            "design": design,
+            "factors": [dataclasses.asdict(f) for f in factors],
+            "base": list(base),
+            "points": points if design != "grid" else None,
+            "seed": seed if design != "grid" else None,
+        }
+        if path.exists():
+            doc = json.loads(path.read_text())
+            if doc["spec"] != spec:
+                raise ValueError(f"{path} holds another sweep; choose another checkpoint file or the same design")
+            sw = SweepCheckpoint(path, spec, doc["points"])
+            sw.results = {int(k): v for k, v in doc["results"].items()}
+            _logger.info("Resuming the sweep in %s: %d of %d trials done", path, sw.done, len(sw.points))
+            return sw
+        if any(not 0 <= f.index < len(base) for f in factors):
+            raise ValueError(f"The factors must index the {len(base)} demag values")
+        vectors = []
+        for values in make_design(design, factors, points, seed):
+            v = list(base)
+            for f, x in zip(factors, values):
+                v[f.index] = x
+            vectors.append(v)
+        sw = SweepCheckpoint(path, spec, vectors)
+        sw._save()
+        return sw
+
+    @property
+    def done(self) -> int:
+        return len(self.results)
+
+    def pending(self, current: Sequence[int] | None) -> list[int]:
+        """The indices of the trials still to run, in the order to run them."""
+        todo = [i for i in range(len(self.points)) if i not in self.results]
+        if current is not None:
+            todo.sort(key=lambda i: self.points[i] != list(current))  # Stable: the rest keep the design order.
+        return todo
+
+    def record(self, index: int, **result: float) -> None:
+        self.results[index] = result
+        self._save()
+
+    def _save(self) -> None:
+        doc = {"spec": self._spec, "points": self.points, "results": self.results}
+        tmp = self._path.with_name(self._path.name + ".tmp")
+        tmp.write_text(json.dumps(doc, indent=1))
+        os.replace(tmp, self._path)
+
+    def report(self) -> str:
+        indices = [f["index"] for f in self._spec["factors"]]
+        aborted = [i for i, r in self.results.items() if "aborted" in r]
+        lines = [
+            f"Sweep {self._spec['design']} over factors {', '.join(map(str, indices))}: "
+            f"{self.done} of {len(self.points)} trials done, {len(aborted)} aborted",
+            "F_peak [N]  values",
+        ]
+        for i, r in sorted(self.results.items(), key=lambda kv: kv[1].get("peak", float("inf"))):
+            values = " ".join(str(self.points[i][k]) for k in indices)
+            if "peak" in r:
+                lines.append(f"{r['peak']:>10.2f}  {values}")
+            else:
+                lines.append(f"{'aborted':>10}  {values} ({r['aborted']:.1f} N)")
+        return "\n".join(lines)
@@ -0,0 +1,85 @@
+from __future__ import annotations
+
+import logging
+import numpy as np
+from scipy.stats import norm
+from typing import Any, Callable, Sequence
+from numpy.typing import ArrayLike, NDArray
+
+from surrogate import SparseGaussianProcess
+
+_logger = logging.getLogger(__name__)
+
+
+class FeasibilityModel:
+    """
+    A constraint GP over the demag space that predicts the largest force a trial will reach, so that the proposals
+    likely to overload the rig can be screened out before they are run. The probability of feasibility is the
+    posterior probability that the largest force stays below the limit.
+
+    Every trial contributes the largest force it reached: the feasible ones the largest sample, the aborted ones
+    the force at which they were aborted. The latter is only a lower bound of what the trial would have reached,
+    so the model is optimistic near the known violations, with the probability tending to 0.5 there rather than 0;
+    a screening threshold above 0.5 keeps the optimizer away from them anyway.
+
+    Until :attr:`min_observations` trials are known, every proposal is considered feasible.
+
+    >>> fm = FeasibilityModel(limit=15.0, min_observations=4)
+    >>> fm.probability([[0.0]])
+    array([1.])
+    >>> for x in np.linspace(0, 10, 21):
+    ...     fm.add([x], 2.0 * x, feasible=2.0 * x < 15.0)
+    >>> fm.violations
+    6
+    >>> p = fm.probability([[1.0], [9.5]])
+    >>> bool(p[0] > 0.99), bool(p[1] < 0.01)
+    (True, True)
+    """
+
+    def __init__(
+        self,
+        limit: float,
+        min_observations: int = 5,
+        model_factory: Callable[[], Any] = SparseGaussianProcess,
+    ) -> None:
+        self.limit = limit
+        self.min_observations = min_observations
+        self._model_factory = model_factory
+        self._x: list[list[float]] = []
+        self._force: list[float] = []
+        self._feasible: list[bool] = []
+        self._model: Any = None
+
+    @property
+    def observations(self) -> int:
+        return len(self._x)
+
+    @property
+    def violations(self) -> int:
+        return self._feasible.count(False)
+
+    def add(self, x: Sequence[float], max_force: float, feasible: bool) -> None:
+        self._x.append([float(v) for v in x])
+        self._force.append(float(max_force))
+        self._feasible.append(feasible)
+        self._model = None  # Refitted lazily on the next query.
+
+    def probability(self, xs: ArrayLike) -> NDArray[np.float64]:
+        """The probability that each of the points stays within the force limit."""
+        xs = np.atleast_2d(np.asarray(xs, dtype=np.float64))
+        if self.observations < self.min_observations:
+            return np.ones(len(xs))
+        if self._model is None:
+            self._model = self._model_factory().fit(np.array(self._x), np.array(self._force))
+        mean, std = self._model.predict(xs, return_std=True)
+        return np.asarray(norm.cdf((self.limit - mean) / std), dtype=np.float64)
+
+    def screen(self, candidates: Sequence[Sequence[float]], threshold: float) -> tuple[int, float]:
+        """
+        Returns the index of the first candidate that is feasible with at least the threshold probability,
+        or of the most probably feasible one if none is; and its probability.
+        """
+        p = self.probability(candidates)
+        ok = np.flatnonzero(p >= threshold)
+        idx = int(ok[0]) if len(ok) else int(np.argmax(p))
+        return idx, float(p[idx])
@@ -0,0 +1,199 @@
+from __future__ import annotations
+
+import json
+import logging
+import dataclasses
+import numpy as np
+from pathlib import Path
+from typing import Any
+from numpy.typing import ArrayLike, NDArray
+from scipy.signal import welch
+
+_logger = logging.getLogger(__name__)
+
+
+@dataclasses.dataclass(frozen=True)
+class NoiseProfile:
+    """
+    The noise power spectral density of each force channel and of their sum, estimated from an unloaded segment.
+    Knowing the spectrum rather than just the variance matters because the noise of the strain gauges is not white:
+    mains pickup and mechanical resonances are attenuated very differently by filters of similar depth.
+
+    White noise of 0.1 N per channel at 100 Hz:
+
+    >>> rng = np.random.default_rng(0)
+    >>> t = np.arange(0, 60, 0.01)
+    >>> p = NoiseProfile.from_samples(t, rng.normal(0, 0.1, (len(t), 2)))
+    >>> round(p.sample_rate), round(p.std(0), 2), round(p.std(), 2)
+    (100, 0.1, 0.14)
+    >>> round(p.filtered_std(4), 2), round(p.filtered_std(4, difference=True), 2)  # 0.14 * sqrt(1/4), sqrt(2/4)
+    (0.07, 0.1)
+    >>> NoiseProfile.from_dict(json.loads(json.dumps(p.to_dict()))) == p
+    True
+    """
+
+    sample_rate: float
+    """[Hz]"""
+    freqs: NDArray[np.float64]
+    """[Hz]"""
+    psd: NDArray[np.float64]
+    """One-sided PSD [N^2/Hz], one row per channel and the sum of the channels last."""
+
+    @staticmethod
+    def from_samples(t: ArrayLike, forces: ArrayLike, segment: int = 256) -> NoiseProfile:
+        """
+        ``t`` are the timestamps [s], ``forces`` the calibrated forces with one column per channel.
+        The sample rate is taken from the whole span, because the samples arrive from the port in bursts.
+        """
+        t = np.asarray(t, dtype=np.float64)
+        x = np.asarray(forces, dtype=np.float64)
+        x = np.column_stack([x, x.sum(axis=1)])
+        fs = (len(t) - 1) / float(t[-1] - t[0])
+        freqs, psd = welch(x, fs=fs, nperseg=min(segment, len(x)), detrend="constant", axis=0)
+        return NoiseProfile(sample_rate=fs, freqs=freqs, psd=psd.T.copy())
+
+    @property
+    def channel_count(self) -> int:
+        return len(self.psd) - 1
+
+    def std(self, channel: int = -1) -> float:
+        """Standard deviation of the noise of the channel, or of the sum of the channels by default [N]."""
+        return self.filtered_std(1, channel)
+
+    def filtered_std(self, depth: int, channel: int = -1, difference: bool = False) -> float:
+        """
+        The noise left after a moving average of ``depth`` samples. With ``difference``, it is the noise of the
+        change of the filtered force over ``depth`` samples, which is what a drop detector on that filter sees.
+        """
+        w = np.pi * self.freqs / self.sample_rate
+        with np.errstate(invalid="ignore", divide="ignore"):
+            h = np.where(w == 0, 1.0, np.sin(w * depth) / (depth * np.sin(w)))
+        gain = h**2
+        if difference:
+            gain = gain * (2 * np.sin(w * depth)) ** 2
+        df = self.freqs[1] - self.freqs[0]
+        return float(np.sqrt(np.sum(self.psd[channel] * gain) * df))
+
+    def to_dict(self) -> dict[str, Any]:
+        return {"sample_rate": self.sample_rate, "freqs": self.freqs.tolist(), "psd": self.psd.tolist()}
+
+    @staticmethod
+    def from_dict(d: dict[str, Any]) -> NoiseProfile:
+        return NoiseProfile(
+            sample_rate=float(d["sample_rate"]),
+            freqs=np.asarray(d["freqs"], dtype=np.float64),
+            psd=np.asarray(d["psd"], dtype=np.float64),
+        )
+
+    def __eq__(self, other: object) -> bool:
+        return (
+            isinstance(other, NoiseProfile)
+            and self.sample_rate == other.sample_rate
+            and np.array_equal(self.freqs, other.freqs)
+            and np.array_equal(self.psd, other.psd)
+        )
+
+
+@dataclasses.dataclass(frozen=True)
+class NoiseRequirement:
+    """What a detector needs from its input: the noise must stay below ``max_std`` [N]."""
+
+    max_std: float
+    difference: bool = False
+    """The detector compares the force against its earlier value rather than against a level."""
+    max_lag: float | None = None
+    """The longest delay the detector can tolerate [s]; the noise requirement is relaxed to meet it."""
+
+
+@dataclasses.dataclass(frozen=True)
+class FilterChoice:
+    depth: int
+    """Moving average depth, i.e., the order of the FIR filter."""
+    lag: float
+    """[s] Group delay for a level detector; the time for a step to show in full for a difference detector."""
+    cutoff: float
+    """[Hz] The -3 dB frequency."""
+    noise: float
+    """[N] The noise the detector sees with this filter."""
+    meets_requirement: bool
+
+
+def tune(profile: NoiseProfile, requirement: NoiseRequirement, max_depth: int = 64) -> FilterChoice:
+    """
+    Picks the least-lag moving average that brings the noise of the sum of the channels below the requirement.
+    If no depth within the lag limit (or ``max_depth``) is enough, the deepest allowed one is returned.
+
+    >>> rng = np.random.default_rng(0)
+    >>> t = np.arange(0, 60, 0.01)
+    >>> p = NoiseProfile.from_samples(t, rng.normal(0, 0.1, (len(t), 2)))
+    >>> c = tune(p, NoiseRequirement(0.05))
+    >>> c.depth, round(c.lag, 3), round(c.cutoff, 1), c.meets_requirement
+    (9, 0.04, 4.9, True)
+    >>> tune(p, NoiseRequirement(0.5)).depth  # Quiet enough unfiltered.
+    1
+    >>> c = tune(p, NoiseRequirement(0.01, max_lag=0.05))
+    >>> c.depth, c.meets_requirement
+    (11, False)
+    """
+    fs = profile.sample_rate
+    best: FilterChoice | None = None
+    for depth in range(1, max_depth + 1):
+        lag = (depth if requirement.difference else (depth - 1) / 2) / fs
+        if requirement.max_lag is not None and lag > requirement.max_lag and best is not None:
+            break
+        noise = profile.filtered_std(depth, difference=requirement.difference)
+        best = FilterChoice(
+            depth=depth,
+            lag=lag,
+            cutoff=0.443 * fs / depth if depth > 1 else fs / 2,
+            noise=noise,
+            meets_requirement=noise <= requirement.max_std,
+        )
+        if best.meets_requirement:
+            return best
+    assert best is not None
+    _logger.info("No filter meets %s; using %s", requirement, best)
+    return best
+
+
+@dataclasses.dataclass(frozen=True)
+class FilterTuning:
+    """The outcome of the characterization step: the noise profile and the filter chosen for each detector."""
+
+    profile: NoiseProfile
+    choices: dict[str, FilterChoice]
+
+    def depth(self, name: str) -> int:
+        return self.choices[name].depth if name in self.choices else 1
+
+    def report(self) -> str:
+        lines = [
+            f"Noise at {self.profile.sample_rate:.1f} Hz: "
+            + ", ".join(f"ch{i} {self.profile.std(i):.3f} N" for i in range(self.profile.channel_count))
+            + f", sum {self.profile.std():.3f} N"
+        ]
+        for name, c in self.choices.items():
+            lines.append(
+                f"{name}: depth {c.depth}, lag {c.lag * 1e3:.0f} ms, cutoff {c.cutoff:.1f} Hz, "
+                f"noise {c.noise:.3f} N" + ("" if c.meets_requirement else " (requirement not met)")
+            )
+        return "\n".join(lines)
+
+    def save(self, path: Path) -> None:
+        doc = {
+            "profile": self.profile.to_dict(),
+            "choices": {k: dataclasses.asdict(v) for k, v in self.choices.items()},
+        }
+        path.write_text(json.dumps(doc, indent=1))
+
+    @staticmethod
+    def load(path: Path) -> FilterTuning:
+        doc = json.loads(path.read_text())
+        return FilterTuning(
+            profile=NoiseProfile.from_dict(doc["profile"]),
+            choices={k: FilterChoice(**v) for k, v in doc["choices"].items()},
+        )
+
+
+def tune_all(profile: NoiseProfile, requirements: dict[str, NoiseRequirement]) -> FilterTuning:
+    return FilterTuning(profile, {name: tune(profile, req) for name, req in requirements.items()})
@@ -0,0 +1,131 @@
+from __future__ import annotations
+
+import enum
+import time
+import signal
+import struct
+import logging
+import threading
+import dataclasses
+from pathlib import Path
+from typing import Iterator
+
+_logger = logging.getLogger(__name__)
+
+
+class EventCode(enum.IntEnum):
+    """
+    The meaning of the integer and float arguments is documented per event.
+    """
+
+    PACKET_PARSED = 1  # a: payload size, b: remaining backlog size
+    PACKET_CRC_ERROR = 2  # a: payload size
+    READING = 3  # a: seq_num
+    DISCONTINUITY = 4  # a: seq_num
+    RECONNECT = 5  # a: reconnection count
+    COMMAND_SENT = 6  # a: command
+    WRITE_DRAINED = 7  # a: bytes written, b: drain latency [s]
+    FORCE = 8  # b: force [N]
+
+
+@dataclasses.dataclass(frozen=True)
+class Event:
+    timestamp: float
+    """Monotonic time in seconds."""
+    code: EventCode | int
+    a: int
+    b: float
+
+    def __str__(self) -> str:
+        name = self.code.name if isinstance(self.code, EventCode) else str(self.code)
+        return f"{self.timestamp:017.6f} {name:<17} {self.a:>11} {self.b:+.6e}"
+
+
+class FlightRecorder:
+    """
+    A fixed-size in-memory ring of binary events for the hot paths, where stdlib logging is too expensive.
+    Recording an event is a single struct.pack_into; the events are only decoded when someone reads them,
+    which normally happens when the ring is dumped on error or on request (see :func:`dump_on_signal`).
+    Recording is thread-safe as long as the GIL is there; the worst case is a torn event in a dump.
+
+    >>> fr = FlightRecorder(capacity=3)
+    >>> len(fr.events())
+    0
+    >>> for i in range(5):
+    ...     fr.record(EventCode.READING, i, i * 0.5)
+    >>> [(e.code, e.a, e.b) for e in fr.events()]  # doctest: +NORMALIZE_WHITESPACE
+    [(<EventCode.READING: 3>, 2, 1.0), (<EventCode.READING: 3>, 3, 1.5), (<EventCode.READING: 3>, 4, 2.0)]
+    >>> fr.total
+    5
+    >>> fr.record(99)
+    >>> fr.events()[-1].code
+    99
+    """
+
+    _RECORD = struct.Struct(r"< q H 6x q d")
+
+    DEFAULT_CAPACITY = 65536
+
+    def __init__(self, capacity: int = DEFAULT_CAPACITY) -> None:
+        if capacity < 1:
+            raise ValueError(f"Invalid capacity: {capacity}")
+        self._capacity = capacity
+        self._buffer = bytearray(self._RECORD.size * capacity)
+        self._total = 0
+
+    @property
+    def total(self) -> int:
+        """Number of events recorded since creation, including the ones that have been overwritten."""
+        return self._total
+
+    def record(self, code: int, a: int = 0, b: float = 0.0) -> None:
+        self._RECORD.pack_into(
+            self._buffer,
+            (self._total % self._capacity) * self._RECORD.size,
+            time.monotonic_ns(),
+            code,
+            a,
+            b,
+        )
+        self._total += 1
+
+    def events(self) -> list[Event]:
+        """Decodes the retained events in chronological order."""
+        return list(self._iter_events())
+
+    def dump(self, path: str | Path) -> Path:
+        """Writes the retained events into a text file, one per line. Returns the path."""
+        path = Path(path)
+        with open(path, "w") as f:
+            f.write(f"# {self._total} events recorded, {min(self._total, self._capacity)} retained\n")
+            for ev in self._iter_events():
+                f.write(f"{ev}\n")
+        _logger.warning("Flight recorder dumped into %s", path.resolve())
+        return path
+
+    def _iter_events(self) -> Iterator[Event]:
+        start = max(0, self._total - self._capacity)
+        for i in range(start, self._total):
+            t_ns, code, a, b = self._RECORD.unpack_from(self._buffer, (i % self._capacity) * self._RECORD.size)
+            try:
+                code = EventCode(code)
+            except ValueError:
+                pass
+            yield Event(timestamp=t_ns * 1e-9, code=code, a=a, b=b)
+
+
+RECORDER = FlightRecorder()
+"""The process-wide recorder used by the hot paths."""
+
+DEFAULT_DUMP_PATH = Path("flight_recorder.log")
+
+
+def dump_on_signal(path: str | Path = DEFAULT_DUMP_PATH, signum: int = signal.SIGUSR1) -> None:
+    """
+    Dumps the process-wide recorder into the file whenever the signal is received (SIGUSR1 by default),
+    so that the recent history of a long run can be inspected with ``kill -USR1 <pid>`` without stopping it.
+    Only works from the main thread.
+    """
+    if threading.current_thread() is not threading.main_thread():
+        raise RuntimeError("Signal handlers can only be installed from the main thread")
+    signal.signal(signum, lambda *_: RECORDER.dump(path))
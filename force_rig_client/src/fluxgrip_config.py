@@ -1,14 +1,16 @@
 from __future__ import annotations
 
 import re
+import time
 import pycyphal
 import logging
 import asyncio
 import collections.abc
+import numpy as np
 
 from typing import Optional
 from pathlib import Path
-from typing import Iterator, Awaitable
+from typing import Iterator, Awaitable, Sequence
 
 from pycyphal.application import Node, make_transport
 from pycyphal.application.node_tracker import NodeTracker
@@ -24,8 +26,12 @@ from uavcan.primitive.scalar import Integer8_1
 from uavcan.register import Access_1, List_1, Name_1
 from zubax.fluxgrip import Feedback_0
 
+from rig_metrics import REGISTRY
+
 _logger = logging.getLogger(__name__)
 
+_M_OPERATION = REGISTRY.histogram("fmr_fluxgrip_operation_seconds", "Duration of FluxGrip operations", ["operation"])
+
 
 class RegisterProxy(collections.abc.Mapping[str, pycyphal.application.register.ValueProxyWithFlags]):
     _VALID_PAT = re.compile(r"^[a-z_]+(\.\w+)+[<=>]?$")
@@ -161,6 +167,8 @@ class FluxGripConfig:
 
         # TargetNode-related
         self._register_proxy: Optional[RegisterProxy] = None
+        self._demag_values: tuple[int, ...] | None = None
+        self._unique_id: str | None = None
 
     async def wait_for_node_online(self) -> None:
         fluxgrip_found = False
@@ -170,6 +178,7 @@ class FluxGripConfig:
                 if node_info and node_info.name.tobytes().decode() == "com.zubax.fluxgrip":
                     assert node_id == DEFAULT_TARGET_NODE_ID, "Expects FluxGrip to have DEFAULT_TARGET_NODE_ID"
                     _logger.debug("FluxGrip found!")
+                    self._unique_id = bytes(node_info.unique_id).hex()
                     fluxgrip_found = True
                 else:
                     await asyncio.sleep(1)
@@ -207,6 +216,8 @@ class FluxGripConfig:
 
         self._register_proxy = RegisterProxy(self._controller_node, DEFAULT_TARGET_NODE_ID)
         await self._register_proxy.reload()
+        if "magnet.demag" in self._register_proxy:
+            self._demag_values = tuple(self._register_proxy["magnet.demag"].ints)
 
         _logger.debug("Setting up Command publisher")
         self._pub_command = self._controller_node.make_publisher(Integer8_1, EXPECTED_COMMAND_TOPIC_ID)
@@ -220,6 +231,7 @@ class FluxGripConfig:
 
     async def configure_demag_cycle(self, demag_val: Integer32_1):
         assert len(demag_val.value) == 51
+        started_at = time.monotonic()
         _logger.debug(f"Setting new demag cycle values: {demag_val}")
         res = int(await self._register_proxy.write_through("magnet.demag", demag_val))
         _logger.debug(f"Read back demag values: {res}")
@@ -230,6 +242,27 @@ class FluxGripConfig:
         assert resp.status == ExecuteCommand_1.Response.STATUS_SUCCESS
         await asyncio.sleep(5)  # Give some time for reboot to start
         await self.wait_for_node_online()
+        _M_OPERATION.labels("configure").observe(time.monotonic() - started_at)
+
+    @property
+    def unique_id(self) -> str | None:
+        """The 128-bit unique ID of the FluxGrip unit in hex, once it has been found online."""
+        return self._unique_id
+
+    @property
+    def demag_values(self) -> tuple[int, ...] | None:
+        """The demag values the FluxGrip is configured with, as read at the start or written since."""
+        return self._demag_values
+
+    async def configure_demag_values(self, values: Sequence[int]) -> None:
+        # Writing the register takes a reboot; if the values are already there, the current config is reused.
+        values = tuple(int(v) for v in values)
+        if values == self._demag_values:
+            _logger.debug("Demag values unchanged, not reconfiguring")
+            return
+        self._demag_values = None  # Unknown until the reboot has succeeded.
+        await self.configure_demag_cycle(Integer32_1(np.array(values, dtype=np.int32)))
+        self._demag_values = values
 
     async def magnetize(self) -> None:
         while await self._sub_feedback.get(0):
@@ -239,6 +272,7 @@ class FluxGripConfig:
         assert feedback_msg.magnetized == False
 
         assert await self._pub_command.publish(Integer8_1(value=1))
+        started_at = time.monotonic()
 
         async def wait_for_magnet_to_magnetize() -> None:
             feedback_msg = await self._sub_feedback.get(5)
@@ -251,6 +285,7 @@ class FluxGripConfig:
         try:
             await asyncio.wait_for(wait_for_magnet_to_magnetize(), timeout=10)
             _logger.debug("Magnetized successfully")
+            _M_OPERATION.labels("magnetize").observe(time.monotonic() - started_at)
         except asyncio.TimeoutError:
             raise TimeoutError("Timeout while waiting for magnet to magnetize")
 
@@ -262,6 +297,7 @@ class FluxGripConfig:
         assert feedback_msg.magnetized == True
 
         assert await self._pub_command.publish(Integer8_1(value=0))
+        started_at = time.monotonic()
 
         async def wait_for_magnet_to_demagnetize() -> None:
             feedback_msg = await self._sub_feedback.get(5)
@@ -274,5 +310,6 @@ class FluxGripConfig:
         try:
             await asyncio.wait_for(wait_for_magnet_to_demagnetize(), timeout=60)
             _logger.debug("Demagnetized successfully")
+            _M_OPERATION.labels("demagnetize").observe(time.monotonic() - started_at)
         except asyncio.TimeoutError:
             raise TimeoutError("Timeout while waiting for magnet to demagnetize")
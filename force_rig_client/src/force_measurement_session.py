@@ -1,137 +1,384 @@
 import time
+import dataclasses
 import numpy as np
 import click
 import emoji
 import asyncio
 
+from pathlib import Path
 from force_rig import ForceRig
 from fluxgrip_config import FluxGripConfig
 from serial import Serial
 from client_utils import inform
-from uavcan.primitive.array import Integer32_1
+from cycle_metrics import CycleMetrics, compute_cycle_metrics
+from trace_archive import TraceArchive
+from trial_cache import TrialCache
+from peak_prediction import PeakPredictor, PeakPredicted
+from trial_protocol import (
+    DETACHED,
+    ForceLimitExceeded,
+    LinkInterrupted,
+    TravelLimitExceeded,
+    ProtocolRunner,
+    RigState,
+    Trace,
+    standard_protocol,
+)
+from filter_tuning import FilterTuning, NoiseProfile, NoiseRequirement, tune_all
+from live_plot import SampleBuffer, LivePlot
+from downsampling import lttb_indices
+from realtime import RealtimeConfig, apply_to_process, jitter_report
+from rig_metrics import REGISTRY
 from matplotlib import pyplot
 
+_M_CYCLE_TIME = REGISTRY.histogram("fmr_cycle_seconds", "Duration of one measurement sample, from descent to report")
+_M_TRIALS = REGISTRY.counter("fmr_trials_total", "Measurement samples completed")
+_M_LAST_PEAK = REGISTRY.gauge("fmr_last_peak_newtons", "Estimated peak force of the last sample")
+_M_OVERLOADS = REGISTRY.counter("fmr_overloads_total", "Trials aborted because the force limit was exceeded")
+_M_CACHE_HITS = REGISTRY.counter("fmr_trial_cache_hits_total", "Cycles answered from the archive without the rig")
+_M_REPEATS = REGISTRY.counter("fmr_trial_repeats_total", "Cycles deliberately rerun on already measured demag values")
+
+
 class ForceMeasurementSession:
-    def __init__(self, force_port: Serial, drive_port: Serial):
-        self._force_rig = ForceRig(drive_port, force_port)
+    DELTA_THRESHOLD = 0.5
+    NUMBER_OF_SAMPLES = 2
+    MAX_FORCE = 15.0 # To prevent damage to the setup
+    LIFT_CLEARANCE = 1.0
+    """In the minimal-lift mode, how far above the contact height [s of arm travel] to lift after detachment."""
+    LIFT_PRESS_TIME = 1.0
+    """In the minimal-lift mode, how long [s] to press on after the contact, instead of the full 10 s."""
+    TOUCH_FORCE = -1.0 # Once pressure sensor detect 1N, we can assume the plate has touched the magnet
+    NOISE_MARGIN = 5.0
+    """With the tuned filters, the detectors see the noise at most 1/NOISE_MARGIN of their thresholds (sigma)."""
+    CHARACTERIZATION_TIME = 5.0
+    PLOT_POINTS = 2000
+    """Of each curve in the result plots; the longer traces are downsampled."""
+    LINK_RETRIES = 3
+    """How many times a trial interrupted by a reconnection or a device restart is rerun before giving up."""
+
+    def __init__(
+        self,
+        force_port: Serial,
+        drive_port: Serial,
+        archive: TraceArchive | None = None,
+        latency_export: Path | None = None,
+        minimal_lift: bool = False,
+        duplicates: str = "repeat",
+        screening_sigma: float | None = None,
+        tune_filters: bool = False,
+        live_plot: bool = False,
+        realtime: RealtimeConfig | None = None,
+    ):
+        """
+        If the archive is given, demag values that have already been measured under the same rig configuration
+        (including the force sensor, its calibration, and the FluxGrip unit, see :attr:`rig_config`) are measured
+        again and counted as deliberate repeats if ``duplicates`` is "repeat". With "reuse", they are not measured
+        again: the archived results are returned instead, and the values that have overloaded the rig are refused.
+
+        With ``screening_sigma``, the session runs low-fidelity screening trials: the pull stops as soon as the peak
+        predicted from the rising force is known within this many newtons (one sigma). The predictor is fitted on
+        the full pulls in the archive; if there are not enough of them, full pulls are done.
+
+        With ``tune_filters``, the setup records the unloaded sensor and picks the least-lag smoothing of each
+        detector that keeps it from firing on the noise; the result is saved into the archive directory.
+
+        With ``live_plot``, a window shows the force of the last seconds with the thresholds, the contact,
+        and the detachments while the session runs (see :class:`live_plot.LivePlot`).
+
+        With ``realtime``, the reader threads of the ports run with that scheduling, and the event loop, which also
+        runs the analysis, is kept off their core (see :mod:`realtime`); the cleanup reports what has been achieved
+        and the jitter of the reading arrivals.
+        """
+        self._force_rig = ForceRig(drive_port, force_port, realtime=realtime)
+        self._realtime = realtime
+        self._archive = archive
+        if screening_sigma is not None and archive is None:
+            raise ValueError("The screening mode needs the archive of full pulls")
+        self._requested_screening_sigma = screening_sigma
+        self._screening_sigma: float | None = None
+        self._predictor: PeakPredictor | None = None
+        self._trial_cache: TrialCache | None = None
+        self._identity: dict = {}
+        if duplicates not in ("reuse", "repeat"):
+            raise ValueError(f"Invalid duplicates policy: {duplicates!r}")
+        if duplicates == "reuse" and archive is None:
+            raise ValueError("Reusing the archived results needs the archive")
+        self._duplicates = duplicates
+        self._latency_export = latency_export
         self._fluxgrip_config = FluxGripConfig()
-        self._t_current: float = 0 # We assume we're starting from top position
+        self._rig_state = RigState() # We assume we're starting from top position
+        self._minimal_lift = minimal_lift
+        self._tune_filters = tune_filters
+        self._filter_tuning: FilterTuning | None = None
+        self._runner = self._make_runner()
         self._test_index: int = 0
         self._best_so_far: float = 99
         self._best_so_far_index: int = 0
+        self._last_metrics: list[CycleMetrics] = []
+        self._samples = SampleBuffer()
+        self._live_plot = (
+            LivePlot(self._samples, thresholds={"max force": self.MAX_FORCE, "touch": self.TOUCH_FORCE})
+            if live_plot
+            else None
+        )
+        self._live_plot_task: asyncio.Task[None] | None = None
+
+    @property
+    def rig_config(self) -> dict:
+        """
+        The settings and the devices that affect the measured values; trials are only comparable if these match.
+        The devices are only known once the session has been set up.
+        """
+        config: dict = {
+            "delta_threshold": self.DELTA_THRESHOLD,
+            "number_of_samples": self.NUMBER_OF_SAMPLES,
+            **self._identity,
+        }
+        if self._screening_sigma is not None:
+            # The peaks of the screening trials are predicted, so they are kept apart from the measured ones.
+            config["screening_sigma"] = self._screening_sigma
+        return config
+
+    @property
+    def last_metrics(self) -> list[CycleMetrics]:
+        """Metrics of each sample of the last completed cycle."""
+        return self._last_metrics
+
+    @property
+    def configured_demag_values(self) -> tuple[int, ...] | None:
+        return self._fluxgrip_config.demag_values
+
+    @property
+    def filter_tuning(self) -> FilterTuning | None:
+        return self._filter_tuning
+
+    def _make_runner(self) -> ProtocolRunner:
+        tuning = self._filter_tuning
+        return standard_protocol(
+            self.DELTA_THRESHOLD,
+            self.MAX_FORCE,
+            touch_force=self.TOUCH_FORCE,
+            minimal_lift=self._minimal_lift,
+            lift_clearance=self.LIFT_CLEARANCE,
+            lift_press_time=self.LIFT_PRESS_TIME,
+            early_stop=(
+                PeakPredicted(self._predictor, self._screening_sigma)
+                if self._predictor is not None and self._screening_sigma is not None
+                else None
+            ),
+            touch_smoothing=tuning.depth("touch") if tuning else 1,
+            detach_smoothing=tuning.depth("detach") if tuning else 1,
+        ).compile()
+
+    async def _characterize_noise(self) -> None:
+        inform(f"Recording the unloaded force sensor for {self.CHARACTERIZATION_TIME:.0f} s to tune the filters")
+        t, forces = await self._force_rig.record_forces(self.CHARACTERIZATION_TIME)
+        self._filter_tuning = tune_all(
+            NoiseProfile.from_samples(t, forces),
+            {
+                "touch": NoiseRequirement(abs(self.TOUCH_FORCE) / self.NOISE_MARGIN),
+                "detach": NoiseRequirement(self.DELTA_THRESHOLD / self.NOISE_MARGIN, difference=True),
+            },
+        )
+        inform(self._filter_tuning.report())
+        if self._archive is not None:
+            path = self._archive.path / "filter_tuning.json"
+            self._filter_tuning.save(path)
+            inform(f"Filter tuning saved to {path}")
+        self._runner = self._make_runner()
 
     async def setup(self):
+        if self._realtime is not None:
+            inform(f"Real-time scheduling: {apply_to_process(self._realtime)}")
         inform("ForceRig setup")
         await self._force_rig.setup()
+        if self._tune_filters:
+            await self._characterize_noise()
         inform("FluxGripConfig setup")
         await self._fluxgrip_config.start()
+        self._identity = {**self._force_rig.identity, "fluxgrip": self._fluxgrip_config.unique_id}
+        if self._archive is not None:
+            self._open_archive(self._archive)
+        if self._live_plot is not None:
+            self._live_plot_task = asyncio.get_running_loop().create_task(self._live_plot.run())
+
+    def _open_archive(self, archive: TraceArchive) -> None:
+        """Fits the peak predictor and opens the trial cache on the trials of this rig configuration."""
+        if self._requested_screening_sigma is not None:
+            self._predictor = PeakPredictor.from_archive(
+                archive, self.rig_config, detach_threshold=self.DELTA_THRESHOLD
+            )
+            if self._predictor is None:
+                inform("Not enough full pulls in the archive to predict the peaks, screening is disabled", fg="yellow")
+            else:
+                self._screening_sigma = self._requested_screening_sigma
+                self._runner = self._make_runner()
+        self._trial_cache = TrialCache(archive, self.rig_config)
+
+    def _lookup_cached(self, demag_values) -> float | None:
+        """
+        Returns the mean archived peak if these demag values have been measured enough times already and duplicates
+        are reused; then also raises ForceLimitExceeded if they have overloaded the rig before.
+        """
+        hit = self._trial_cache.lookup(demag_values) if self._trial_cache is not None else None
+        if hit is None:
+            return None
+        if self._duplicates == "reuse" and hit.aborted_ids:
+            raise ForceLimitExceeded(self._trial_cache.aborted_force(hit), self.MAX_FORCE)
+        if self._duplicates == "reuse" and hit.count >= self.NUMBER_OF_SAMPLES:
+            self._last_metrics = [
+                compute_cycle_metrics(tr.columns["t"], tr.columns["f"], detach_threshold=self.DELTA_THRESHOLD)
+                for tr in self._trial_cache.trials(hit)
+            ]
+            _M_CACHE_HITS.inc()
+            inform(f"\nAlready measured {hit.count} times, reusing F_peak {hit.mean:.2f} N (std {hit.std:.2f} N)")
+            return hit.mean
+        _M_REPEATS.inc()
+        inform(f"\nMeasured {hit.count} times before, repeating deliberately")
+        return None
 
     async def cleanup(self):
         inform("ForceMeasurementSession cleanup")
-        if self._t_current > 0:
-            inform(f"Returning to start position: {self._t_current:.2f} s")
-            await self._force_rig.move_arm_up_for(self._t_current)
+        if self._rig_state.position > 0:
+            inform(f"Returning to start position: {self._rig_state.position:.2f} s")
+            await self._force_rig.move_arm_up_for(self._rig_state.position)
         await self._force_rig.stop_arm()
         await self._force_rig.close()
         self._fluxgrip_config.close()
+        if self._live_plot_task is not None:
+            self._live_plot_task.cancel()
+            inform(self._live_plot.report())
+        for st in self._force_rig.realtime_status:
+            inform(f"Real-time scheduling: {st}")
+        inform(jitter_report(self._force_rig.arrival_intervals))
+        inform(f"Acquisition latency per stage:\n{self._force_rig.latency_profile.report()}")
+        if self._latency_export is not None:
+            self._force_rig.latency_profile.export(self._latency_export)
+            inform(f"Latency histograms exported to {self._latency_export}")
+
+    @staticmethod
+    def _show_progress(counter: int, f_instant: float) -> None:
+        fmt = click.style(f"#{counter:06d}: ", dim=True)
+        fmt += click.style(f"F_instant = {f_instant:+08.1f} N", fg="green", bold=True)
+        inform(f"\r{fmt}  ", nl=False)
+
+    def _on_sample(self, counter: int, f_instant: float) -> None:
+        self._show_progress(counter, f_instant)
+        if self._live_plot is None:
+            return
+        self._samples.append(time.monotonic(), f_instant)  # The clock of the protocol runner.
+
+    def _on_report(self, s: str) -> None:
+        inform(f"\n{s}")
+        if s.startswith("Stopped moving down"):
+            self._samples.mark("contact", time.monotonic())
+        elif s == DETACHED:  # Where the detachment detector of the protocol has fired.
+            self._samples.mark("detachment", time.monotonic())
+
+    async def _run_trial(self, demag_values) -> Trace:
+        """Runs one trial; one that a link interruption has cut is discarded, never archived, and run again."""
+        retries = 0
+        while True:
+            try:
+                return await self._runner.run(
+                    self._force_rig,
+                    self._fluxgrip_config,
+                    demag_values,
+                    self._rig_state,
+                    report=self._on_report,
+                    progress=self._on_sample,
+                )
+            except LinkInterrupted as ex:
+                retries += 1
+                if retries > self.LINK_RETRIES:
+                    raise
+                inform(f"\n{ex}; the trial is discarded and run again", fg="yellow")
 
     async def run_cycle(self, demag_values, fixed_pre_demag_values = None) -> float:
-        NUMBER_OF_SAMPLES = 2
-        samples = [0] * NUMBER_OF_SAMPLES
+        samples = [0] * self.NUMBER_OF_SAMPLES
+        metrics: list[CycleMetrics] = []
+
+        if fixed_pre_demag_values is not None and len(demag_values) < 51:
+            demag_values = fixed_pre_demag_values + demag_values
+        if (cached := self._lookup_cached(demag_values)) is not None:
+            return cached
 
         for sample_index in range(0, len(samples)):
 
             try:
-                if fixed_pre_demag_values is not None and len(demag_values) < 51:
-                    demag_values = fixed_pre_demag_values + demag_values
                 assert len(demag_values) == 51, "Length of demag parameter is 51"
-                new_demag_values = Integer32_1(np.array(
-                    demag_values,
-                    dtype=np.int32,
-                ))
+                cycle_started_at = time.monotonic()
                 inform(f"\nTesting demag values: {demag_values}")
-                await self._fluxgrip_config.configure_demag_cycle(new_demag_values)
-
-                inform("Moving arm downwards until TOUCH_FORCE is detected")
-
-                TOUCH_FORCE = -1.0 # Once pressure sensor detect 1N, we can assume the plate has touched the magnet
-                start_time_down = time.time()
-                await self._force_rig.move_arm_down()
-                counter = 0
-                while True:
-                    f_instant = await self._force_rig.get_instant_force()
-                    fmt = click.style(f"#{counter:06d}: ", dim=True)
-                    fmt += click.style(f"F_instant = {f_instant:+08.1f} N", fg="green", bold=True)
-                    inform(f"\r{fmt}", nl=False)
-                    if f_instant < TOUCH_FORCE:
-                        break
-                    counter +=1
-
-                await self._force_rig.move_arm_down_for(10.0) # To be sure the plate is completely flat on the magnet
-                self._t_current = time.time() - start_time_down
-
-                # Magnetize and demagnetize
-                inform("\nMagnetizing and demagnetizing")
-                await self._fluxgrip_config.magnetize()
-                await asyncio.sleep(1)
-                await self._fluxgrip_config.demagnetize()
-                await asyncio.sleep(1)
-
-                # Move arm up and print the force sensor data
-                # 2 stop conditions:
-                # 1. if t_current risks becoming negative (we've reached the top)
-                # 2. if plate has detached (Force drops by DELTA_THRESHOLD)
-                DELTA_THRESHOLD = 0.5
-                start_time_up = time.time()
-                await self._force_rig.move_arm_up()
-                counter = 0
-                f_peak = 0.0
-                f_instant_storage = []
-                plate_detached = False
-                data_timeout = time.time()
-                while True:
-                    f_instant = await self._force_rig.get_instant_force()
-                    f_instant_storage.append(f_instant)
-                    fmt = click.style(f"#{counter:06d}: ", dim=True)
-                    f_peak = f_instant if f_instant > f_peak else f_peak
-                    fmt += click.style(f"f_instant = {f_instant:+08.1f} N", fg="green", bold=True)
-                    fmt += click.style(f" f_peak = {f_peak:+08.1f} N", fg="cyan", bold=True)
-                    inform(f"\r{fmt}  ", nl=False)
-                    counter +=1
-                    if time.time() - start_time_up > self._t_current:
-                        inform("\nTop reached "+emoji.emojize(":melting_face:"))
-                        await self._force_rig.stop_arm()
-                        assert False
-                    if len(f_instant_storage) > 2:
-                        if f_instant_storage[-2] - f_instant_storage[-1] > DELTA_THRESHOLD and not plate_detached:
-                            inform("Plate detached!")
-                            plate_detached = True
-                            data_timeout = time.time() + 10 # we collect a bit more data and make sure the plate is completely removed from magnet
-                    if plate_detached:
-                        if time.time() > data_timeout:
-                            break
+                try:
+                    trace = await self._run_trial(demag_values)
+                except ForceLimitExceeded as ex:
+                    _M_OVERLOADS.inc()
+                    if self._archive is not None and ex.trace is not None:
+                        self._archive.append({"t": ex.trace.t, "f": ex.trace.f}, demag_values, self.rig_config)
+                    inform(f"\nForce limit exceeded, trial aborted: {ex.force:.1f} N", fg="red")
+                    raise
+                except TravelLimitExceeded:
+                    inform("\nTop reached "+emoji.emojize(":melting_face:"))
+                    raise
+                t_storage, f_instant_storage = trace.t, trace.f
+                DELTA_THRESHOLD = self.DELTA_THRESHOLD
 
-                await self._force_rig.stop_arm()
-                total_time_up = time.time() - start_time_up
-                self._t_current -= total_time_up
+                # All derived quantities are computed here at once; the protocol runner only acquires the samples.
+                # The largest sample underestimates the true peak, so the estimate from the timestamps is used.
+                m = compute_cycle_metrics(t_storage, f_instant_storage, detach_threshold=DELTA_THRESHOLD)
+                if self._predictor is not None and m.detach_time is None:
+                    pred = self._predictor.predict(t_storage, f_instant_storage)
+                    if pred is not None:
+                        inform("\nPull stopped before detachment, F_peak predicted from the rising force", fg="cyan")
+                        m = dataclasses.replace(
+                            m,
+                            peak=dataclasses.replace(m.peak, force=pred.force, sigma=pred.sigma, detached=False),
+                        )
+                metrics.append(m)
+                peak = m.peak
+                f_peak = peak.force
+                if self._archive is not None:
+                    self._archive.append(
+                        {"t": t_storage, "f": f_instant_storage},
+                        demag_values,
+                        self.rig_config,
+                        peak=peak.force,
+                        peak_sigma=peak.sigma,
+                    )
+                inform(
+                    f"\nF_peak: sampled {peak.sampled:.2f} N, estimated {peak.force:.2f} ± {peak.sigma:.2f} N; "
+                    f"time to peak {m.time_to_peak:.1f} s, slope {m.pre_detach_slope:.2f} N/s, "
+                    f"impulse {m.impulse:.1f} N*s, noise {m.noise:.3f} N"
+                )
 
-                # Plot out the result
+                # Plot out the result. However long the pull, at most PLOT_POINTS are drawn, chosen by LTTB so that
+                # the peak and the detachment edge stay as they are; the markers are only drawn for the short pulls.
                 fig, axs = pyplot.subplots(2, 1, figsize=(10, 8))
+                t_plot = np.asarray(t_storage) - t_storage[0]
+                f_plot = np.asarray(f_instant_storage)
+                edge = []
+                if m.detach_time is not None:
+                    detach = int(np.searchsorted(t_storage, m.detach_time))
+                    edge = [detach, detach + 1]
+                idx = lttb_indices(t_plot, f_plot, self.PLOT_POINTS, keep=edge)
+                sparse = len(idx) == len(f_plot)
 
-                axs[0].plot(f_instant_storage, marker='o', color='blue')
+                axs[0].plot(t_plot[idx], f_plot[idx], marker='o' if sparse else None, color='blue')
                 axs[0].set_title("F_instant")
-                axs[0].set_xlabel("Time")
+                axs[0].set_xlabel("Time [s]")
                 axs[0].set_ylabel("Force [N]")
                 axs[0].axhline(y=f_peak, color='red', linestyle='--', label='f_peak')
+                axs[0].axhline(y=peak.sampled, color='gray', linestyle=':', label='sampled max')
                 axs[0].grid(True)
 
                 # First derivative
-                f_diff = np.diff(f_instant_storage)
-                t_diff = range(1, len(f_instant_storage)) # is 1 point shorter
+                f_diff = np.diff(f_plot)
+                t_diff = t_plot[1:] # is 1 point shorter
+                idx = lttb_indices(t_diff, f_diff, self.PLOT_POINTS, keep=edge[:1])
 
-                axs[1].plot(t_diff, f_diff, marker='x', color='orange')
+                axs[1].plot(t_diff[idx], f_diff[idx], marker='x' if sparse else None, color='orange')
                 axs[1].set_title("F_instant: first derivative")
-                axs[1].set_xlabel("Time")
+                axs[1].set_xlabel("Time [s]")
                 axs[1].set_ylabel("ΔF / Δt")
                 axs[1].axhline(y=-DELTA_THRESHOLD, color='red', linestyle='--', label='delta_threshold')
                 axs[1].grid(True)
@@ -139,14 +386,18 @@ class ForceMeasurementSession:
                 # Demag values used and resulting remaining magnetic force
                 test_value_counter = 1
                 demag_text =  "Demag values: " + ', '.join(map(str, demag_values))
-                result_text = f"\nF_peak: {f_peak:.2f} N"
+                result_text = f"\nF_peak: {f_peak:.2f} ± {peak.sigma:.2f} N (sampled max {peak.sampled:.2f} N)"
                 fig.text(0.5, 0.01, demag_text+result_text, ha='center', va='bottom', fontsize=8, wrap=True)
 
                 pyplot.tight_layout(rect=[0, 0.06, 1, 1])  # leave space for the text
-                pyplot.savefig(f"result_{self._test_index}", format="png")
+                fig.savefig(f"result_{self._test_index}", format="png")
+                pyplot.close(fig)
 
                 self._test_index +=1
                 samples[sample_index] = f_peak
+                _M_TRIALS.inc()
+                _M_LAST_PEAK.set(f_peak)
+                _M_CYCLE_TIME.observe(time.monotonic() - cycle_started_at)
 
             except KeyboardInterrupt:
                 await self._force_rig.stop_arm()
@@ -154,6 +405,7 @@ class ForceMeasurementSession:
                 self._fluxgrip_config.close()
                 pass
 
+        self._last_metrics = metrics
         result = sum(samples)/len(samples)
         if result < self._best_so_far:
             self._best_so_far = result
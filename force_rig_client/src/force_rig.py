@@ -4,28 +4,39 @@ import time
 import serial
 import numpy as np
 
-from fluxgrip_config import FluxGripConfig
+from pathlib import Path
 from force_sensor_interface import ForceSensorInterface
 from step_drive_control import StepDriveControl
-from client_utils import inform
+from latency_profile import LatencyProfile, LatencyHistogram
+from realtime import RealtimeConfig, RealtimeStatus
+from trial_protocol import LinkInterrupted
 
-from typing import Optional
+from typing import Optional, Literal
 from numpy.typing import NDArray
 
-# DSDL imports
-from uavcan.primitive.array import Integer32_1
-
 _logger = logging.getLogger(__name__)
 
 
 class ForceRig:
-    def __init__(self, step_drive_port: serial.Serial, force_sensor_port: serial.Serial):
-        self._step_drive_control = StepDriveControl(step_drive_port)
-        self._force_sensor_interface = ForceSensorInterface(force_sensor_port)
+    def __init__(
+        self,
+        step_drive_port: serial.Serial,
+        force_sensor_port: serial.Serial,
+        event_driven: bool = False,
+        confirm: Literal["echo", "ack"] = "echo",
+        realtime: RealtimeConfig | None = None,
+    ):
+        """See :class:`StepDriveControl` and :class:`serial_interface.IOManager` for the I/O options."""
+        self._step_drive_control = StepDriveControl(step_drive_port, event_driven, confirm, realtime)
+        self._force_sensor_interface = ForceSensorInterface(
+            force_sensor_port, event_driven=event_driven, realtime=realtime
+        )
+        self._links_seen = (0, 0)
 
     async def setup(self):
         await self._step_drive_control.stop()
         _ = await self._force_sensor_interface.get_instant_forces(calibrate=True)
+        self._links_seen = self._link_counts()
 
     async def close(self):
         await self._step_drive_control.stop()
@@ -40,10 +51,7 @@ class ForceRig:
 
         await self._step_drive_control.down()
 
-        end_time = time.time() + timeout
-        while True:
-            if time.time() > end_time:
-                break
+        await asyncio.sleep(timeout)
         # and stop arm!
         await self._step_drive_control.stop()
 
@@ -53,10 +61,7 @@ class ForceRig:
     async def move_arm_up_for(self, timeout: float) -> None:
         await self._step_drive_control.up()
 
-        end_time = time.time() + timeout
-        while True:
-            if time.time() > end_time:
-                break
+        await asyncio.sleep(timeout)
         # and stop arm!
         await self._step_drive_control.stop()
 
@@ -66,8 +71,70 @@ class ForceRig:
     async def stop_arm(self) -> None:
         await self._step_drive_control.stop()
 
+    async def calibrate_zero(self) -> None:
+        """Measures the zero bias of the force sensor anew; the sensor should be unloaded."""
+        _ = await self._force_sensor_interface.get_instant_forces(calibrate=True)
+        self._links_seen = self._link_counts()
+
+    async def record_forces(self, duration: float) -> tuple[NDArray[np.float64], NDArray[np.float64]]:
+        """
+        The forces of the given time as the trial detectors see them, to characterize the noise they have to reject:
+        one :meth:`get_instant_force` sample after another, skipping the readings that arrive in between, so the rate
+        is that of the detectors rather than that of the sensor. Timestamps [s] and forces per channel.
+        """
+        loop = asyncio.get_running_loop()
+        t: list[float] = []
+        forces: list[NDArray[np.float64]] = []
+        end = loop.time() + duration
+        while loop.time() < end:
+            forces.append(await self._force_sensor_interface.get_instant_forces())
+            t.append(loop.time())
+        return np.array(t), np.array(forces)
+
     async def get_instant_force(self) -> float:
+        """Raises LinkInterrupted if a port has been reopened or a device has restarted since the zero calibration."""
         forces = await self._force_sensor_interface.get_instant_forces()
+        if (counts := self._link_counts()) != self._links_seen:
+            self._links_seen = counts
+            raise LinkInterrupted("The force stream or the drive link was interrupted during the trial")
         return sum(forces)
 
+    def _link_counts(self) -> tuple[int, int]:
+        return self._force_sensor_interface.discontinuity_count, self._step_drive_control.reconnect_count
+
+    def mark_decided(self) -> None:
+        """Invoke after acting on the last force value to complete its latency record."""
+        self._force_sensor_interface.mark_decided()
+
+    @property
+    def identity(self) -> dict:
+        """
+        What identifies the force sensor and its calibration, to tell the trials of another setup apart:
+        the stable port name (it holds the USB serial number) and the calibration reported at the last zero
+        calibration.
+        """
+        path = self._force_sensor_interface.stable_path
+        cal = self._force_sensor_interface.device_calibration
+        return {
+            "force_sensor": Path(path).name if path is not None else None,
+            "calibration": cal.round(9).tolist() if cal is not None else None,
+        }
+
+    @property
+    def latency_profile(self) -> LatencyProfile:
+        return self._force_sensor_interface.latency_profile
+
+    @property
+    def arrival_intervals(self) -> LatencyHistogram:
+        return self._force_sensor_interface.arrival_intervals
+
+    @property
+    def realtime_status(self) -> list[RealtimeStatus]:
+        """Of the reader threads that have started."""
+        return [
+            st
+            for st in (self._force_sensor_interface.realtime_status, self._step_drive_control.realtime_status)
+            if st is not None
+        ]
+
 
@@ -12,20 +12,29 @@ import sys
 import numpy as np
 
 from typing import Any, Callable, Coroutine
+from pathlib import Path
 from shutil import get_terminal_size
 
 from matplotlib.pyplot import savefig
-from skopt import gp_minimize
 from skopt.space import Integer
 
 from client_utils import inform, coroutine
+import flight_recorder
+from profiling import profile_option
+from realtime import RealtimeConfig, realtime_option
 
 from force_rig import ForceRig
 from force_sensor_interface import ForceSensorInterface
 from fluxgrip_config import FluxGripConfig
 # from src.bayesian_optimizer import search_space
 from step_drive_control import StepDriveControl
-from force_measurement_session import ForceMeasurementSession
+from force_measurement_session import ForceMeasurementSession, ForceLimitExceeded
+from trace_archive import TraceArchive
+from cycle_metrics import compute_cycle_metrics
+from surrogate import SURROGATES, make_optimizer
+from feasibility import FeasibilityModel
+from doe import DESIGNS, Design, Factor, SweepCheckpoint
+import rig_metrics
 
 from uavcan.primitive.array import Integer32_1
 
@@ -40,13 +49,23 @@ _logger = logging.getLogger(__name__)
     },
 )
 @click.option("--verbose", "-v", count=True, help="Emit verbose log messages. Specify twice for extra verbosity.")
-def cli(verbose: int) -> None:
+@profile_option
+@click.option(
+    "--metrics-port",
+    type=int,
+    metavar="PORT",
+    help="Serve the rig performance counters in the Prometheus text format at http://localhost:PORT/metrics",
+)
+def cli(verbose: int, metrics_port: int | None) -> None:
     log_level = {
         0: logging.WARNING,
         1: logging.INFO,
         2: logging.DEBUG,
     }.get(verbose or 0, logging.DEBUG)
     logging.root.setLevel(log_level)
+    flight_recorder.dump_on_signal()
+    if metrics_port is not None:
+        rig_metrics.serve(metrics_port)
 
 
 force_sensor_port_option = click.option(
@@ -79,30 +98,275 @@ step_drive_port_option = click.option(
 )
 
 
+minimal_lift_option = click.option(
+    "--minimal-lift",
+    is_flag=True,
+    help="Between the pulls, lift the arm only slightly above the contact height instead of pulling on for 10 s, "
+    "and press for 1 s instead of 10 s after the contact",
+)
+
+
+duplicates_option = click.option(
+    "--duplicates",
+    type=click.Choice(["reuse", "repeat"]),
+    default="repeat",
+    show_default=True,
+    help="What to do with demag values already measured under the same rig configuration "
+    "(the same settings, force sensor, calibration, and FluxGrip unit): "
+    "measure them again as deliberate repeats, or reuse the archived results",
+)
+
+
+screening_option = click.option(
+    "--screening-sigma",
+    type=float,
+    metavar="NEWTONS",
+    help="Screening mode: stop each pull once its peak is predicted within this uncertainty (one sigma) "
+    "from the rising force; the predictor is fitted on the full pulls in the archive",
+)
+
+
+tune_filters_option = click.option(
+    "--tune-filters",
+    is_flag=True,
+    help="At the start, record the unloaded sensor and tune the detector filters to its noise spectrum",
+)
+
+
+live_plot_option = click.option(
+    "--live-plot",
+    is_flag=True,
+    help="Show the force of the last 30 s in a window that is updated live during the pulls",
+)
+
+
+latency_export_option = click.option(
+    "--latency-export",
+    type=click.Path(dir_okay=False, writable=True, path_type=Path),
+    metavar="FILE",
+    help="Export the per-stage acquisition latency histograms into this JSON file at the end of the session",
+)
+
+
+archive_option = click.option(
+    "--archive",
+    metavar="DIR",
+    help="Directory of the trace archive to store the trials in (created if missing); without it, nothing is archived",
+    callback=lambda ctx, param, value: TraceArchive(value) if value is not None else None,
+)
+
+
 @cli.command()
 @force_sensor_port_option
 @step_drive_port_option
+@archive_option
+@latency_export_option
+@minimal_lift_option
+@duplicates_option
+@screening_option
+@tune_filters_option
+@live_plot_option
+@realtime_option
 @coroutine
-async def execute(force_port: serial.Serial, drive_port: serial.Serial) -> None:
+async def execute(
+    force_port: serial.Serial,
+    drive_port: serial.Serial,
+    archive: TraceArchive | None,
+    latency_export: Path | None,
+    minimal_lift: bool,
+    duplicates: str,
+    screening_sigma: float | None,
+    tune_filters: bool,
+    live_plot: bool,
+    realtime: RealtimeConfig | None,
+) -> None:
     """
     Execute a full force measurement cycle.
     Assumes that start is with arm at top position
     """
     test_values = [[-100,-90,-81,+73,+66,-59,-53,+48,+43,-39,-35,+31,+28,-25,-23,+21,+19,-17,-15,+14,-12,+11,-10,+9, 50, -45, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0],
                    [-100,-90,-81,+73,+66,-59,-53,+48,+43,-39,-35,+31,+28,-25,-23,+21,+19,-17,-15,+14,-12,+11,-10,+9, -50, 45, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0]]
-    force_measurement_session = ForceMeasurementSession(force_port, drive_port)
+    force_measurement_session = ForceMeasurementSession(
+        force_port,
+        drive_port,
+        archive,
+        latency_export,
+        minimal_lift,
+        duplicates,
+        screening_sigma,
+        tune_filters,
+        live_plot,
+        realtime,
+    )
     await force_measurement_session.setup()
 
     for value in test_values:
-        average = await force_measurement_session.run_cycle(value)
+        try:
+            average = await force_measurement_session.run_cycle(value)
+        except ForceLimitExceeded as ex:
+            inform(f"\nSkipping the demag values: {ex}", fg="red")
+            continue
         inform(f"\naverage f_peak: {average:.1f}")
 
     await force_measurement_session.cleanup()
 
+
+# The first vector of execute; the factors of a sweep replace some of its values.
+DEFAULT_SWEEP_BASE = "-100,-90,-81,73,66,-59,-53,48,43,-39,-35,31,28,-25,-23,21,19,-17,-15,14,-12,11,-10,9,50,-45" + ",0" * 25
+
+
+def _parse_factors(ctx: click.Context, param: click.Parameter, value: tuple[str, ...]) -> list[Factor]:
+    try:
+        return [Factor.parse(v) for v in value]
+    except ValueError as ex:
+        raise click.BadParameter(str(ex)) from None
+
+
 @cli.command()
 @force_sensor_port_option
 @step_drive_port_option
-def optimize(force_port: serial.Serial, drive_port: serial.Serial) -> None:
+@archive_option
+@latency_export_option
+@minimal_lift_option
+@duplicates_option
+@screening_option
+@tune_filters_option
+@live_plot_option
+@click.option("--design", type=click.Choice(DESIGNS), default="lhs", show_default=True, help="Design of the sweep")
+@click.option(
+    "--factor",
+    "factors",
+    multiple=True,
+    required=True,
+    metavar="INDEX:LOW:HIGH[:LEVELS]",
+    callback=_parse_factors,
+    help="A demag value to vary (0-based index) and its integer range; the grid takes LEVELS values of it "
+    "or every value. Give once per factor",
+)
+@click.option("--points", "-n", default=16, show_default=True, help="Trials of the lhs and sobol designs")
+@click.option("--seed", default=0, show_default=True, help="Seed of the lhs and sobol designs")
+@click.option(
+    "--base",
+    default=DEFAULT_SWEEP_BASE,
+    metavar="V1,V2,...",
+    help="The 51 demag values that the factors modify  [default: the first vector of execute]",
+    callback=lambda ctx, param, value: [int(v) for v in value.split(",")],
+)
+@click.option(
+    "--checkpoint",
+    default="sweep.json",
+    show_default=True,
+    type=click.Path(dir_okay=False, path_type=Path),
+    metavar="FILE",
+    help="Where the design and the completed trials are saved after each trial; rerun to resume",
+)
+@realtime_option
+@coroutine
+async def sweep(
+    force_port: serial.Serial,
+    drive_port: serial.Serial,
+    archive: TraceArchive | None,
+    latency_export: Path | None,
+    minimal_lift: bool,
+    duplicates: str,
+    screening_sigma: float | None,
+    tune_filters: bool,
+    live_plot: bool,
+    design: Design,
+    factors: list[Factor],
+    points: int,
+    seed: int,
+    base: list[int],
+    checkpoint: Path,
+    realtime: RealtimeConfig | None,
+) -> None:
+    """
+    Run a design-of-experiments sweep over some of the demag values: a grid, a Latin hypercube, or a Sobol'
+    sequence. Every trial is checkpointed; rerunning the same command resumes the sweep where it stopped.
+    Assumes that start is with arm at top position
+    """
+    if len(base) != 51:
+        raise click.BadParameter(f"expected 51 values, got {len(base)}", param_hint="base")
+    try:
+        sweep_state = SweepCheckpoint.open(checkpoint, base, factors, design, points, seed)
+    except ValueError as ex:
+        raise click.UsageError(str(ex)) from None
+    inform(f"Sweep: {sweep_state.done} of {len(sweep_state.points)} trials done, checkpoint in {checkpoint}")
+    force_measurement_session = ForceMeasurementSession(
+        force_port,
+        drive_port,
+        archive,
+        latency_export,
+        minimal_lift,
+        duplicates,
+        screening_sigma,
+        tune_filters,
+        live_plot,
+        realtime,
+    )
+    await force_measurement_session.setup()
+    try:
+        for index in sweep_state.pending(force_measurement_session.configured_demag_values):
+            try:
+                average = await force_measurement_session.run_cycle(sweep_state.points[index])
+            except ForceLimitExceeded as ex:
+                inform(f"\nSkipping the demag values: {ex}", fg="red")
+                sweep_state.record(index, aborted=ex.force)
+                continue
+            sweep_state.record(index, peak=average)
+            inform(f"\nTrial {sweep_state.done} of {len(sweep_state.points)}: average f_peak {average:.1f}")
+    finally:
+        await force_measurement_session.cleanup()
+    inform(sweep_state.report())
+
+
+@cli.command()
+@force_sensor_port_option
+@step_drive_port_option
+@archive_option
+@latency_export_option
+@minimal_lift_option
+@duplicates_option
+@screening_option
+@tune_filters_option
+@live_plot_option
+@click.option(
+    "--surrogate",
+    type=click.Choice(SURROGATES),
+    default="gp",
+    show_default=True,
+    help="Surrogate model of the optimizer; the exact GP gets slow beyond a few hundred trials, prefer sparse-gp",
+)
+@click.option("--n-calls", default=300, show_default=True, help="Number of trials to run")
+@click.option(
+    "--feasibility-threshold",
+    default=0.6,
+    show_default=True,
+    help="Proposals less likely than this to stay within the force limit are replaced before they reach the rig",
+)
+@click.option(
+    "--timing-log",
+    type=click.Path(dir_okay=False, writable=True, path_type=Path),
+    metavar="FILE",
+    help="Write the wall time spent per iteration on the trial and on the model into this CSV file",
+)
+@realtime_option
+def optimize(
+    force_port: serial.Serial,
+    drive_port: serial.Serial,
+    archive: TraceArchive | None,
+    latency_export: Path | None,
+    minimal_lift: bool,
+    duplicates: str,
+    screening_sigma: float | None,
+    tune_filters: bool,
+    live_plot: bool,
+    surrogate: str,
+    n_calls: int,
+    feasibility_threshold: float,
+    timing_log: Path | None,
+    realtime: RealtimeConfig | None,
+) -> None:
     """
     Optimize
     """
@@ -111,7 +375,18 @@ def optimize(force_port: serial.Serial, drive_port: serial.Serial) -> None:
         8, 0, 24, -1, 7, -24, 11, -16, 24, -9, 17, -12, 10, -15, 22, -4, 9, -8, 3, -10, 7, -11, 2, 0, 5, -2
     ]
     y0 = 5.1
-    force_measurement_session = ForceMeasurementSession(force_port, drive_port)
+    force_measurement_session = ForceMeasurementSession(
+        force_port,
+        drive_port,
+        archive,
+        latency_export,
+        minimal_lift,
+        duplicates,
+        screening_sigma,
+        tune_filters,
+        live_plot,
+        realtime,
+    )
 
     loop = asyncio.new_event_loop()
     loop.run_until_complete(force_measurement_session.setup())
@@ -137,18 +412,112 @@ def optimize(force_port: serial.Serial, drive_port: serial.Serial) -> None:
         # ensure integers
         search_space.append(Integer(int(lower), int(upper)))
 
-    def optimize_target(params) -> float:
+    m_iterations = rig_metrics.REGISTRY.counter("fmr_optimizer_iterations_total", "Objective evaluations")
+    m_best = rig_metrics.REGISTRY.gauge("fmr_optimizer_best_newtons", "Best objective value so far")
+    m_best.set(y0)
+    m_model_time = rig_metrics.REGISTRY.histogram(
+        "fmr_optimizer_model_seconds", "Time spent fitting the surrogate and choosing the next point per iteration"
+    )
+
+    # Overloads are constraint violations: they train the feasibility model, and the objective model gets
+    # an imputed value so that it moves on.
+    feasibility = FeasibilityModel(ForceMeasurementSession.MAX_FORCE)
+    SCREEN_CANDIDATES = 8
+
+    def optimize_target(params) -> float | None:
+        """None if no sample of the cycle has completed, which says nothing about the point."""
         FIXED_PRE_DEMAG_VALUES = [-100,-90,-81,+73,+66,-59,-53,+48,+43,-39,-35,+31,+28,-25,-23,+21,+19,-17,-15,+14,-12,+11,-10,+9,-8]
-        result = loop.run_until_complete(force_measurement_session.run_cycle(params, FIXED_PRE_DEMAG_VALUES))
+        try:
+            result = loop.run_until_complete(force_measurement_session.run_cycle(params, FIXED_PRE_DEMAG_VALUES))
+        except ForceLimitExceeded as ex:
+            feasibility.add(params, ex.force, feasible=False)
+            raise
+        if not force_measurement_session.last_metrics:
+            return None
+        feasibility.add(params, max(m.peak.sampled for m in force_measurement_session.last_metrics), feasible=True)
+        m_iterations.inc()
+        m_best.set(min(m_best.value, result))
         return result
 
 
-    res = gp_minimize(optimize_target, search_space, n_calls=300, random_state=42, x0=x0, y0=y0)
+    opt = make_optimizer(surrogate, search_space, random_state=42)
+    res = opt.tell(x0, y0)
+    timing = open(timing_log, "w") if timing_log else None
+    if timing:
+        timing.write("iteration,observations,ask_s,trial_s,tell_s,objective\n")
+    try:
+        for it in range(n_calls):
+            t0 = time.perf_counter()
+            x = opt.ask()
+            if feasibility.probability([x])[0] < feasibility_threshold:
+                candidates = opt.ask(n_points=SCREEN_CANDIDATES)
+                idx, p_feasible = feasibility.screen(candidates, feasibility_threshold)
+                _logger.info("Proposal screened out as likely overload, using candidate %d (p=%.2f)", idx, p_feasible)
+                x = candidates[idx]
+            t1 = time.perf_counter()
+            try:
+                y = optimize_target(x)
+            except ForceLimitExceeded as ex:
+                # The point must be told, or ask() keeps proposing it. Its peak is at least the force the trial was
+                # aborted at; imputing no less than the worst observation keeps the surrogate away from it.
+                y = max(ex.force, *opt.yi)
+                inform(f"Constraint violation #{feasibility.violations}: {ex}; imputed {y:.1f} N as the objective")
+            if y is None:
+                # Nothing is told, so the same point is proposed and measured again.
+                _logger.warning("Iteration %d discarded: no sample of the cycle has completed", it)
+                continue
+            t2 = time.perf_counter()
+            res = opt.tell(x, y)
+            t3 = time.perf_counter()
+            m_model_time.observe((t1 - t0) + (t3 - t2))
+            _logger.info(
+                "Iteration %d: trial %.1f s, model %.3f s (ask %.3f, tell %.3f) with %d observations",
+                it,
+                t2 - t1,
+                (t1 - t0) + (t3 - t2),
+                t1 - t0,
+                t3 - t2,
+                len(opt.Xi),
+            )
+            if timing:
+                timing.write(f"{it},{len(opt.Xi)},{t1 - t0:.6f},{t2 - t1:.6f},{t3 - t2:.6f},{y}\n")
+                timing.flush()
+    finally:
+        if timing:
+            timing.close()
     inform(f"\n✅ Best force: {res.fun}")
     inform(f"\n🧲 Best demag values: {res.x}")
 
     loop.run_until_complete(force_measurement_session.cleanup())
 
+@cli.command()
+@click.option(
+    "--archive",
+    required=True,
+    type=click.Path(exists=True, file_okay=False, path_type=Path),
+    metavar="DIR",
+    help="Directory of the trace archive to analyze",
+    callback=lambda ctx, param, value: TraceArchive(value),
+)
+@click.option("--trial", "-t", "trials", type=int, multiple=True, help="Trial ID to analyze; all if not specified")
+def analyze(archive: TraceArchive, trials: tuple[int, ...]) -> None:
+    """
+    Compute the cycle metrics of archived trials offline and print them as CSV.
+    """
+    columns = None
+    for trial_id in trials or range(len(archive)):
+        tr = archive.read(trial_id)
+        m = compute_cycle_metrics(
+            tr.columns["t"],
+            tr.columns["f"],
+            detach_threshold=tr.config.get("delta_threshold", ForceMeasurementSession.DELTA_THRESHOLD),
+        ).as_dict()
+        if columns is None:
+            columns = list(m)
+            print(",".join(["trial", "timestamp", *columns]))
+        print(",".join([str(trial_id), f"{tr.timestamp:.3f}", *(f"{m[k]}" for k in columns)]))
+
+
 def main() -> None:  # https://click.palletsprojects.com/en/8.1.x/exceptions/
     status: Any = 1
     # noinspection PyBroadException
@@ -170,9 +539,11 @@ def main() -> None:  # https://click.palletsprojects.com/en/8.1.x/exceptions/
     except Exception as ex:  # pylint: disable=broad-except
         inform(f"Error (run with -v for more info): {type(ex).__name__}: {ex}", fg="red")
         _logger.info("Error: %s: %s", type(ex).__name__, ex, exc_info=True)
+        flight_recorder.RECORDER.dump(flight_recorder.DEFAULT_DUMP_PATH)
     except BaseException as ex:  # pylint: disable=broad-except
         inform(f"Internal error, please report: {ex}", fg="red")
         _logger.exception("%s: %s", type(ex).__name__, ex)
+        flight_recorder.RECORDER.dump(flight_recorder.DEFAULT_DUMP_PATH)
     _logger.debug("EXIT %r", status)
     sys.exit(status)
 
@@ -9,16 +9,21 @@ import click
 import serial
 import numpy as np
 
+from pathlib import Path
 from shutil import get_terminal_size
 from typing import Any
 from numpy.typing import NDArray
 
 from client_utils import inform, coroutine
+import flight_recorder
+from profiling import profile_option
+import rig_metrics
 from force_sensor_interface import (
     ForceSensorReading,
     MovingAverage,
     ForceSensorInterface,
 )
+from filter_tuning import FilterTuning, NoiseProfile
 
 
 logging.basicConfig(level=logging.DEBUG, format="%(asctime)s %(process)07d %(levelname)-3.3s %(name)s: %(message)s")
@@ -32,13 +37,23 @@ _logger = logging.getLogger(__name__)
     },
 )
 @click.option("--verbose", "-v", count=True, help="Emit verbose log messages. Specify twice for extra verbosity.")
-def cli(verbose: int) -> None:
+@profile_option
+@click.option(
+    "--metrics-port",
+    type=int,
+    metavar="PORT",
+    help="Serve the rig performance counters in the Prometheus text format at http://localhost:PORT/metrics",
+)
+def cli(verbose: int, metrics_port: int | None) -> None:
     log_level = {
         0: logging.WARNING,
         1: logging.INFO,
         2: logging.DEBUG,
     }.get(verbose or 0, logging.DEBUG)
     logging.root.setLevel(log_level)
+    flight_recorder.dump_on_signal()
+    if metrics_port is not None:
+        rig_metrics.serve(metrics_port)
 
 
 port_option = click.option(
@@ -93,6 +108,33 @@ async def display(port: serial.Serial, fir_order: int, calibrate_zero_bias: bool
         force_sensor_interface.close()
 
 
+@cli.command()
+@port_option
+@click.option("--duration", "-d", default=10.0, show_default=True, help="Seconds of unloaded data to record")
+@click.option(
+    "--output",
+    "-o",
+    type=click.Path(dir_okay=False, writable=True, path_type=Path),
+    help="Save the noise profile into this JSON file",
+)
+@coroutine
+async def noise(port: serial.Serial, duration: float, output: Path | None) -> None:
+    """
+    Characterize the noise of the unloaded sensor: its spectrum per channel at the full rate of the sensor.
+    Leave the sensor unloaded while this runs.
+    """
+    force_sensor_interface = ForceSensorInterface(port)
+    try:
+        await force_sensor_interface.get_instant_forces(calibrate=True)
+        t, forces = await force_sensor_interface.record(duration)
+    finally:
+        force_sensor_interface.close()
+    tuning = FilterTuning(NoiseProfile.from_samples(t, forces), {})
+    inform(tuning.report())
+    if output is not None:
+        tuning.save(output)
+
+
 @cli.command()
 @port_option
 @click.option("--nsamples", "-n", default=100, show_default=True, help="Number of samples to average per channel")
@@ -212,9 +254,11 @@ def main() -> None:  # https://click.palletsprojects.com/en/8.1.x/exceptions/
     except Exception as ex:  # pylint: disable=broad-except
         inform(f"Error (run with -v for more info): {type(ex).__name__}: {ex}", fg="red")
         _logger.info("Error: %s: %s", type(ex).__name__, ex, exc_info=True)
+        flight_recorder.RECORDER.dump(flight_recorder.DEFAULT_DUMP_PATH)
     except BaseException as ex:  # pylint: disable=broad-except
         inform(f"Internal error, please report: {ex}", fg="red")
         _logger.exception("%s: %s", type(ex).__name__, ex)
+        flight_recorder.RECORDER.dump(flight_recorder.DEFAULT_DUMP_PATH)
     _logger.debug("EXIT %r", status)
     sys.exit(status)
 
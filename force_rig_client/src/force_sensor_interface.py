@@ -1,5 +1,6 @@
 from __future__ import annotations
 
+import time
 import asyncio
 import dataclasses
 import struct
@@ -7,13 +8,20 @@ import serial
 import logging
 import numpy as np
 
-from serial_interface import IOManager, Packet
+from serial_interface import IOManager
+from flight_recorder import RECORDER, EventCode
+from rig_metrics import REGISTRY
+from latency_profile import LatencyProfile, LatencyHistogram, StageTimestamps
+from realtime import RealtimeConfig
 from numpy.typing import NDArray
 from typing import Optional, TypeVar, Generic
 
-logging.basicConfig(level=logging.DEBUG, format="%(asctime)s %(process)07d %(levelname)-3.3s %(name)s: %(message)s")
 _logger = logging.getLogger(__name__)
 
+_M_SAMPLES = REGISTRY.counter("fmr_force_samples_total", "Readings received from the digitizer")
+_M_SAMPLES_LOST = REGISTRY.counter("fmr_force_samples_lost_total", "Readings skipped according to seq_num")
+_M_DISCONTINUITIES = REGISTRY.counter("fmr_force_discontinuities_total", "Digitizer restarts and reconnections")
+
 T = TypeVar("T")
 
 
@@ -58,6 +66,13 @@ class ForceSensorReading:
     seq_num: int
     adc_readings: NDArray[np.int32]
     calibration: NDArray[np.float64]
+    discontinuity: bool = False
+    """
+    True if the stream may have lost samples before this one because the port was reopened
+    or the digitizer has restarted (e.g., by the watchdog); the consumer should not difference across it.
+    """
+    stamps: StageTimestamps = dataclasses.field(default_factory=StageTimestamps, compare=False)
+    """When this reading passed through each stage of the host pipeline; filled in as it goes."""
 
     CHANNEL_COUNT = 2
 
@@ -82,9 +97,11 @@ class ForceSensorInterface(IOManager):
     ...     reading = await reader.fetch(timeout=1)
     ...     assert reading is not None
     ...     assert reading.seq_num == 2
-    ...     assert (reading.adc_readings == [261069056, 73710592, 0, 0]).all()
-    ...     assert reading.calibration.shape == (2, 4)
-    ...     reading = await reader.fetch(timeout=1)
+    ...     assert (reading.adc_readings == [261069056, 73710592]).all()
+    ...     assert reading.calibration.shape == (2, 2)
+    ...     assert not reading.discontinuity
+    ...     _ = port.write(valid_packet)  # Same seq_num again, a duplicated frame.
+    ...     reading = await reader.read(asyncio.get_running_loop().time() + 1)
     ...     assert reading is None
     ...     reader.close()
     >>> asyncio.run(test())
@@ -92,52 +109,145 @@ class ForceSensorInterface(IOManager):
 
     _STRUCT_READING = struct.Struct(r"< Q 8x 8x 16s 40s")
 
-    def __init__(self, port: serial.Serial, fir_order: int = 2) -> None:
-        super().__init__(port)
+    RESTART_WINDOW = 8
+    """How far back a seq_num may go and still be taken for a duplicated or reordered frame rather than a restart."""
+
+    def __init__(
+        self,
+        port: serial.Serial,
+        fir_order: int = 2,
+        event_driven: bool = False,
+        realtime: RealtimeConfig | None = None,
+    ) -> None:
+        super().__init__(port, event_driven, realtime)
         self._port: serial.Serial = port
         self._fir_order: int = fir_order
         self._zero_bias: Optional[NDArray[np.float64]] = None
         self._lpf: Optional[MovingAverage[np.float64]] = None
         self._f_peak: np.float64 = np.float64(0)
+        self._last_seq_num: Optional[int] = None
+        self._restarted_at: Optional[int] = None
+        self._calibration: Optional[NDArray[np.float64]] = None
+        self._device_calibration: Optional[NDArray[np.float64]] = None
+        self._last_stamps: Optional[StageTimestamps] = None
+        self.latency_profile = LatencyProfile(
+            frame_size=self._STRUCT_READING.size + 10,  # Header and CRC.
+            baud=self.BAUD,
+        )
+        self.arrival_intervals = LatencyHistogram()
+        """[ns] Between the arrivals of consecutive readings; their spread is the timing jitter of the host."""
+        self._last_received: int | None = None
+        self._discontinuity_count = 0
+
+    @property
+    def device_calibration(self) -> NDArray[np.float64] | None:
+        """The calibration the digitizer reported at the last zero calibration."""
+        return self._device_calibration
+
+    @property
+    def discontinuity_count(self) -> int:
+        """Of the readings marked as discontinuous so far; a change tells that the stream has had a gap."""
+        return self._discontinuity_count
 
     async def read(self, deadline: float) -> ForceSensorReading | None:
         """
         Waits for up to the specified deadline for a new reading to arrive.
         Returns the new reading, or None if the deadline has expired.
+
+        A reading up to :attr:`RESTART_WINDOW` behind the last one is a duplicated or reordered frame and is dropped.
+        A drop further back or to the start of the count is a restart of the digitizer: the reading is marked
+        as discontinuous, and once the next reading continues the new count, the configuration is reapplied.
+
+        >>> from serial_interface import Packet
+        >>> async def test(seq_nums):
+        ...     port = serial.serial_for_url("loop://")
+        ...     for seq_num in seq_nums:
+        ...         _ = port.write(Packet(memoryview(struct.pack("< Q 72x", seq_num))).compile())
+        ...     reader = ForceSensorInterface(port)
+        ...     sent = []
+        ...     async def send(payload):
+        ...         sent.append(payload)
+        ...     reader.send, reader._calibration = send, np.zeros((2, 2))
+        ...     out = []
+        ...     while (rd := await reader.read(asyncio.get_running_loop().time() + 0.1)) is not None:
+        ...         out.append(rd.seq_num if not rd.discontinuity else f"{rd.seq_num} restart")
+        ...     reader.close()
+        ...     return out, len(sent)
+        >>> asyncio.run(test([100, 101, 101, 103, 102, 104]))
+        ([100, 101, 103, 104], 0)
+        >>> logging.disable(logging.WARNING)
+        >>> asyncio.run(test([100, 101, 0, 1, 2]))
+        ([100, 101, '0 restart', 1, 2], 1)
+        >>> asyncio.run(test([100, 101, 50]))  # Not confirmed yet.
+        ([100, 101, '50 restart'], 0)
+        >>> logging.disable(logging.NOTSET)
         """
         while True:
             if pkt := await self._once():
-                seq_num, adc_readings, calibration = self._STRUCT_READING.unpack_from(pkt.payload)
+                seq_num, adc_readings, calibration = self.decode(pkt.payload)
+                last = self._last_seq_num
+                if last is not None and seq_num <= last and not self._is_restart(last, seq_num):
+                    _logger.debug("%s: Dropping the stale reading %d after %d", self, seq_num, last)
+                    continue
+                discontinuity = self._take_discontinuity()
+                restarted_at, self._restarted_at = self._restarted_at, None
+                if last is not None and seq_num < last:
+                    _logger.warning(
+                        "%s: seq_num went back from %d to %d, the digitizer has restarted", self, last, seq_num
+                    )
+                    discontinuity = True
+                    self._restarted_at = seq_num
+                elif last is not None:
+                    if restarted_at is not None and seq_num - restarted_at <= self.RESTART_WINDOW:
+                        await self._reapply_configuration()
+                    _M_SAMPLES_LOST.inc(seq_num - last - 1)
+                    # Readings that arrive together in one chunk share the stamp and say nothing about the timing.
+                    consecutive = seq_num == last + 1 and not discontinuity
+                    if consecutive and self._last_received not in (None, self._rx_window[1]):
+                        self.arrival_intervals.record(self._rx_window[1] - self._last_received)
+                self._last_received = self._rx_window[1]
+                self._last_seq_num = seq_num
+                _M_SAMPLES.inc()
+                if discontinuity:
+                    self._discontinuity_count += 1
+                    _M_DISCONTINUITIES.inc()
+                RECORDER.record(EventCode.DISCONTINUITY if discontinuity else EventCode.READING, seq_num)
                 rd = ForceSensorReading(
                     seq_num=seq_num,
-                    adc_readings=np.frombuffer(
-                        adc_readings,
-                        dtype=np.int32,
-                        count=ForceSensorReading.CHANNEL_COUNT,
-                    ),
-                    calibration=np.frombuffer(
-                        calibration,
-                        dtype=np.float32,
-                        count=ForceSensorReading.CHANNEL_COUNT * 2,
-                    )
-                    .reshape((2, ForceSensorReading.CHANNEL_COUNT))
-                    .astype(np.float64),
+                    adc_readings=adc_readings,
+                    calibration=calibration,
+                    discontinuity=discontinuity,
+                    stamps=StageTimestamps(polled=self._rx_window[0], received=self._rx_window[1]),
                 )
-                _logger.debug("%s: Received reading %s", self, rd)
+                rd.stamps.parsed = time.perf_counter_ns()
                 return rd
             if deadline < asyncio.get_event_loop().time():
                 return None
-            await asyncio.sleep(1e-3)  # This is silly but works for the MVP.
+            await self._idle()
+
+    @classmethod
+    def decode(cls, payload: memoryview | bytes) -> tuple[int, NDArray[np.int32], NDArray[np.float64]]:
+        """
+        Decodes the payload of a reading packet into the sequence number, the ADC readings, and the calibration.
+        """
+        seq_num, adc_readings, calibration = cls._STRUCT_READING.unpack_from(payload)
+        return (
+            seq_num,
+            np.frombuffer(adc_readings, dtype=np.int32, count=ForceSensorReading.CHANNEL_COUNT),
+            np.frombuffer(calibration, dtype=np.float32, count=ForceSensorReading.CHANNEL_COUNT * 2)
+            .reshape((2, ForceSensorReading.CHANNEL_COUNT))
+            .astype(np.float64),
+        )
 
     async def write_calibration(self, cal: NDArray[np.float64]) -> bool:
         """
         Writes the calibration data to the digitizer and waits for confirmation.
         Returns True if the calibration was accepted, False otherwise (in which case retrying may help).
         """
+        self._calibration = cal.copy()
         payload = cal.astype(np.float32).tobytes()
-        buf = Packet(memoryview(payload)).compile()
-        _logger.debug("%s: Sending calibration packet: %s", self, buf.hex())
-        await asyncio.get_event_loop().run_in_executor(self._executor, self._port.write, buf)
+        _logger.debug("%s: Sending calibration payload: %s", self, payload.hex())
+        await self.send(payload)
         await asyncio.sleep(1.0)  # Wait for the new data to be processed.
         await self.flush()
         rd = await self.read(asyncio.get_event_loop().time() + 10)
@@ -163,24 +273,74 @@ class ForceSensorInterface(IOManager):
 
         return agg / n_samples
 
-    async def fetch(self, flush=False) -> ForceSensorReading:
+    async def fetch(self, flush: bool = False, timeout: float = 10.0) -> ForceSensorReading:
+        """
+        Like :meth:`read` but raises RuntimeError on timeout.
+        If the stream goes silent, the port is reopened once before giving up, so that a USB glitch
+        costs a discontinuity in the stream rather than the whole session.
+        """
         if flush:
             await self.flush()
-        rd = await self.read(deadline=asyncio.get_running_loop().time() + 10.0)
+        rd = await self.read(deadline=asyncio.get_running_loop().time() + timeout)
+        if rd is None and self.stable_path is not None:
+            _logger.warning("%s: No data for %.1f s, assuming the port is lost", self, timeout)
+            await self.reconnect()
+            rd = await self.read(deadline=asyncio.get_running_loop().time() + timeout)
         if rd is None:
             raise RuntimeError("Timed out while waiting for data")
         return rd
 
+    def _is_restart(self, last: int, seq_num: int) -> bool:
+        return seq_num < last and (last - seq_num > self.RESTART_WINDOW or seq_num <= 1)
+
+    async def _reapply_configuration(self) -> None:
+        # The sequence number restarts from zero if the digitizer was reset.
+        self._last_seq_num = None
+        # The calibration is kept in the EEPROM of the digitizer, but if a write was in progress when the device
+        # was lost, it may not have been committed; resend it. The confirmation is checked by the original writer.
+        if self._calibration is not None:
+            await self.send(self._calibration.astype(np.float32).tobytes())
+
     async def get_instant_forces(self, calibrate=False) -> NDArray[np.float64]:
         if calibrate:
             rd = await self.fetch(flush=True)
+            self._device_calibration = rd.calibration
             forces = self.compute_forces(rd)
             self._zero_bias = await self.do_bias_calibration(forces, 50)
             _logger.debug(f"Zero bias: {self._zero_bias} N")
         rd = await self.fetch(flush=True)
         forces = self.compute_forces(rd) - self._zero_bias
+        rd.stamps.calibrated = time.perf_counter_ns()
+        self._last_stamps = rd.stamps
         return forces
 
+    async def record(self, duration: float) -> tuple[NDArray[np.float64], NDArray[np.float64]]:
+        """
+        Collects every reading for the given time and returns the receive timestamps [s] and the zero-corrected forces
+        (one column per channel). Unlike :meth:`get_instant_forces`, no reading is skipped, as needed for spectra.
+        """
+        rd = await self.fetch(flush=True)
+        bias = self._zero_bias if self._zero_bias is not None else 0.0
+        t: list[float] = []
+        forces: list[NDArray[np.float64]] = []
+        loop = asyncio.get_running_loop()
+        end = loop.time() + duration
+        while loop.time() < end:
+            t.append(loop.time())
+            forces.append(self.compute_forces(rd) - bias)
+            rd = await self.fetch()
+        return np.array(t), np.array(forces)
+
+    def mark_decided(self) -> None:
+        """
+        To be invoked by the consumer once it has acted upon the last value returned by :meth:`get_instant_forces`.
+        This completes the latency record of the sample in :attr:`latency_profile`.
+        """
+        if self._last_stamps is not None:
+            self._last_stamps.decided = time.perf_counter_ns()
+            self.latency_profile.add(self._last_stamps)
+            self._last_stamps = None
+
 
 
     @staticmethod
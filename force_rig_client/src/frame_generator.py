@@ -0,0 +1,427 @@
+from __future__ import annotations
+
+import os
+import sys
+import time
+import click
+import serial
+import random
+import struct
+import asyncio
+import logging
+import itertools
+import threading
+import dataclasses
+import numpy as np
+
+from typing import Literal
+
+from serial_interface import Packet
+from latency_profile import LatencyHistogram
+from force_sensor_interface import ForceSensorInterface, ForceSensorReading
+from step_drive_control import StepDriveControl
+
+_logger = logging.getLogger(__name__)
+
+FORCE_FRAME_SIZE = 90
+STEPPER_FRAME_SIZE = 14
+
+
+@dataclasses.dataclass(frozen=True)
+class Impairments:
+    """
+    What goes wrong on the link, per frame. The rates are probabilities in [0, 1].
+    """
+
+    noise: float = 0.0
+    """Mean number of random bytes inserted before each frame (uniformly distributed in [0, 2*noise])."""
+    crc_error_rate: float = 0.0
+    """A byte of the frame after the header is flipped, so the frame fails the CRC check."""
+    truncation_rate: float = 0.0
+    """The frame is cut short at a random point."""
+    seq_gap_rate: float = 0.0
+    """The device skips a sequence number, as if it has dropped a sample; only affects the force frames."""
+
+
+class FrameGenerator:
+    """
+    Produces the frames the force sensor digitizer and the step drive emit, with the configured impairments.
+    The generator keeps track of what it has produced, so the consumer side can be checked for loss.
+
+    >>> gen = FrameGenerator(Impairments(crc_error_rate=0.5, seq_gap_rate=0.2), seed=1)
+    >>> stream = b"".join(gen.force_frame() for _ in range(100))
+    >>> gen.frames, gen.intact + gen.corrupted, gen.seq_gaps > 0
+    (100, 100, True)
+    >>> rem, count = stream, 0
+    >>> while (res := Packet.parse(rem))[1] is not None:
+    ...     rem, count = res[0], count + 1
+    >>> count == gen.intact
+    True
+    >>> len(gen.stepper_frame(-1)) == STEPPER_FRAME_SIZE and len(FrameGenerator().force_frame()) == FORCE_FRAME_SIZE
+    True
+    >>> _, pkt = Packet.parse(FrameGenerator().force_frame(3.0))
+    >>> rd = ForceSensorReading(*ForceSensorInterface.decode(pkt.payload))
+    >>> ForceSensorInterface.compute_forces(rd).round(6).tolist()
+    [1.5, 1.5]
+    """
+
+    _STRUCT_READING = struct.Struct(r"< Q 8x 8x 4l 40s")
+    _CALIBRATION = np.array([[1e-6, -1e-6], [0.0, 0.0]], dtype=np.float32).tobytes().ljust(40, b"\xff")
+    """1 µN per count; the second channel is inverted."""
+
+    def __init__(self, impairments: Impairments = Impairments(), seed: int | None = None) -> None:
+        self._imp = impairments
+        self._rng = random.Random(seed)
+        self._seq_num = 0
+        self.frames = 0
+        self.intact = 0
+        self.corrupted = 0
+        self.seq_gaps = 0
+        self.intact_seq_nums: set[int] = set()
+        """The sequence numbers of the force frames that were emitted intact; these should all be received."""
+
+    @property
+    def seq_num(self) -> int:
+        """The sequence number of the last force frame."""
+        return self._seq_num
+
+    def force_frame(self, force: float | None = None) -> bytes:
+        """
+        One force reading frame, preceded by the noise if configured. The channels read half of ``force`` [N] each;
+        without it, they carry a slow sine.
+        """
+        self._seq_num += 1
+        if self._rng.random() < self._imp.seq_gap_rate:
+            self._seq_num += 1
+            self.seq_gaps += 1
+        adc = int(1e6 * np.sin(self._seq_num * 1e-3)) if force is None else round(force * 0.5e6)
+        payload = self._STRUCT_READING.pack(self._seq_num, adc, -adc, 0, 0, self._CALIBRATION)
+        frame, intact = self._impair(Packet(memoryview(payload)).compile())
+        if intact:
+            self.intact_seq_nums.add(self._seq_num)
+        return frame
+
+    def stepper_frame(self, step: int) -> bytes:
+        """One step drive confirmation frame, preceded by the noise if configured."""
+        return self._impair(Packet(memoryview(struct.pack(r"< i", step))).compile())[0]
+
+    def _impair(self, frame: bytes) -> tuple[bytes, bool]:
+        rng, imp = self._rng, self._imp
+        self.frames += 1
+        noise = rng.randbytes(rng.randint(0, int(2 * imp.noise))) if imp.noise > 0 else b""
+        if rng.random() < imp.truncation_rate:
+            frame = frame[: rng.randrange(1, len(frame))]
+        elif rng.random() < imp.crc_error_rate:
+            damaged = bytearray(frame)
+            damaged[rng.randrange(8, len(frame))] ^= 1 << rng.randrange(8)
+            frame = bytes(damaged)
+        else:
+            self.intact += 1
+            return noise + frame, True
+        self.corrupted += 1
+        return noise + frame, False
+
+
+class MemoryPort:
+    """
+    An in-memory stand-in for serial.Serial with the subset of the API that IOManager uses.
+    The producer calls :meth:`feed` from any thread. Like the OS, the port buffers a limited amount of data;
+    the bytes that do not fit are dropped and counted in :attr:`overrun_bytes`.
+    :meth:`read` blocks for up to :attr:`timeout` like the real port; what the consumer writes is kept in
+    :attr:`written`, from where another thread can take it with :meth:`take_written`.
+
+    >>> p = MemoryPort(capacity=4)
+    >>> p.feed(b"abcdef")
+    >>> p.readall(), p.overrun_bytes, p.readall()
+    (b'abcd', 2, b'')
+    >>> p.timeout = 0.01
+    >>> p.read(1), p.in_waiting
+    (b'', 0)
+    >>> _ = threading.Timer(0.01, p.feed, (b"xyz",)).start()
+    >>> p.timeout = 1.0
+    >>> p.read(1), p.in_waiting
+    (b'x', 2)
+    >>> _ = p.write(b"cmd")
+    >>> p.take_written(), p.take_written()
+    (b'cmd', b'')
+    """
+
+    def __init__(self, capacity: int = 1 << 20) -> None:
+        self._capacity = capacity
+        self._buffer = bytearray()
+        self._lock = threading.Condition()
+        self.port = "memory://"
+        self.timeout: float | None = None
+        self.is_open = True
+        self.overrun_bytes = 0
+        self.written = bytearray()
+
+    def feed(self, data: bytes) -> None:
+        with self._lock:
+            room = self._capacity - len(self._buffer)
+            self._buffer += data[:room]
+            self.overrun_bytes += max(0, len(data) - room)
+            self._lock.notify_all()
+
+    def readall(self) -> bytes:
+        with self._lock:
+            out = bytes(self._buffer)
+            self._buffer.clear()
+        return out
+
+    def read(self, size: int = 1) -> bytes:
+        with self._lock:
+            if not self._buffer and self.timeout:
+                self._lock.wait_for(lambda: bool(self._buffer), self.timeout)
+            out = bytes(self._buffer[:size])
+            del self._buffer[:size]
+        return out
+
+    @property
+    def in_waiting(self) -> int:
+        return len(self._buffer)
+
+    def write(self, data: bytes | memoryview) -> int:
+        with self._lock:
+            self.written += data
+        return len(data)
+
+    def take_written(self) -> bytes:
+        with self._lock:
+            out = bytes(self.written)
+            self.written.clear()
+        return out
+
+    def open(self) -> None:
+        self.is_open = True
+
+    def close(self) -> None:
+        self.is_open = False
+
+
+@dataclasses.dataclass(frozen=True)
+class StressReport:
+    kind: Literal["force", "stepper"]
+    offered_baud: float
+    """The link rate the producer has emulated, 10 bits per byte."""
+    elapsed: float
+    frames_sent: int
+    frames_intact: int
+    frames_received: int
+    frames_lost: int
+    """Intact frames that never made it out of the pipeline."""
+    seq_gaps_injected: int
+    overrun_bytes: int
+    """Bytes dropped because the consumer did not drain the port buffer in time (memory port only)."""
+    batch: int = 1
+    latency: LatencyHistogram = dataclasses.field(default_factory=LatencyHistogram)
+    """[ns] From the start of the transmission of a force frame until it was parsed; empty for the stepper frames."""
+    host_cpu: float = 0.0
+    """[s] CPU time of the consumer side (the pipeline and the reader thread), excluding the producer."""
+
+    @property
+    def cpu_per_frame(self) -> float:
+        return self.host_cpu / self.frames_received if self.frames_received else 0.0
+
+    @property
+    def achieved_frames_per_second(self) -> float:
+        return self.frames_received / self.elapsed if self.elapsed > 0 else 0.0
+
+    @property
+    def loss_ratio(self) -> float:
+        return self.frames_lost / self.frames_intact if self.frames_intact else 0.0
+
+    def __str__(self) -> str:
+        return (
+            f"offered {self.offered_baud / 1e3:.1f} kbaud for {self.elapsed:.2f} s: "
+            f"sent {self.frames_sent}, intact {self.frames_intact}, received {self.frames_received} "
+            f"({self.achieved_frames_per_second:.0f} frames/s), lost {self.frames_lost} ({self.loss_ratio:.2%}), "
+            f"seq gaps {self.seq_gaps_injected}, overrun {self.overrun_bytes} B"
+        )
+
+    TABLE_HEADER = (
+        f"{'frame':<8}{'kbaud':>8}{'batch':>6}{'offered/s':>11}{'delivered/s':>13}{'lost':>8}"
+        f"{'p50 [ms]':>10}{'p99 [ms]':>10}{'CPU/frame [us]':>16}"
+    )
+
+    def table_row(self) -> str:
+        """One row under :attr:`TABLE_HEADER`."""
+        frame_size = FORCE_FRAME_SIZE if self.kind == "force" else STEPPER_FRAME_SIZE
+        lat = [f"{self.latency.percentile(p) * 1e-6:>10.2f}" if self.latency.count else f"{'-':>10}" for p in (50, 99)]
+        return (
+            f"{self.kind:<8}{self.offered_baud / 1e3:>8.1f}{self.batch:>6}"
+            f"{self.offered_baud / 10 / frame_size:>11.0f}{self.achieved_frames_per_second:>13.0f}"
+            f"{self.loss_ratio:>8.1%}{''.join(lat)}{self.cpu_per_frame * 1e6:>16.1f}"
+        )
+
+
+async def run_stress(
+    baud: float,
+    duration: float,
+    kind: Literal["force", "stepper"] = "force",
+    transport: Literal["memory", "pty"] = "memory",
+    impairments: Impairments = Impairments(),
+    seed: int | None = 0,
+    batch: int = 1,
+) -> StressReport:
+    """
+    Feeds the generated stream at the rate equivalent to the given baud through the port into the full pipeline
+    (IOManager and ForceSensorInterface or StepDriveControl) and counts what comes out.
+    With ``batch`` above one, the frames are held back and written that many at a time, like a device that
+    buffers its readings would do; the link rate is the same, but the consumer is woken up less often.
+
+    >>> r = asyncio.run(run_stress(baud=384_000, duration=0.3))
+    >>> r.frames_sent > 100, r.frames_received > 0, r.frames_received + r.frames_lost == r.frames_intact
+    (True, True, True)
+    >>> r.latency.count == r.frames_received, r.host_cpu > 0
+    (True, True)
+    >>> b = asyncio.run(run_stress(baud=384_000, duration=0.3, batch=8))
+    >>> b.frames_received > 0, b.frames_received + b.frames_lost == b.frames_intact
+    (True, True)
+    >>> b.latency.count == b.frames_received
+    True
+    >>> r = asyncio.run(run_stress(baud=38_400, duration=0.3, kind="stepper", impairments=Impairments(noise=4)))
+    >>> r.frames_received > 0, r.frames_received + r.frames_lost == r.frames_intact
+    (True, True)
+    """
+    if batch < 1:
+        raise ValueError(f"Invalid batch size: {batch}")
+    gen = FrameGenerator(impairments, seed)
+    frame_size = FORCE_FRAME_SIZE if kind == "force" else STEPPER_FRAME_SIZE
+    rate = baud / 10 / frame_size
+    total = int(duration * rate)
+    sampled_at: dict[int, int] = {}  # perf_counter_ns of the start of the transmission by seq_num.
+    producer_cpu = 0.0
+    stop = threading.Event()
+    pty_fd: int | None = None
+    port: MemoryPort | serial.Serial
+    if transport == "memory":
+        mem = MemoryPort()
+        port, sink = mem, mem.feed
+    else:
+        pty_fd, slave_fd = os.openpty()
+        port = serial.Serial(os.ttyname(slave_fd), timeout=0)
+        os.close(slave_fd)
+
+        def sink(data: bytes) -> None:
+            view = memoryview(data)
+            while view and not stop.is_set():
+                try:
+                    view = view[os.write(pty_fd, view) :]
+                except BlockingIOError:  # pragma: no cover
+                    time.sleep(1e-4)
+
+    def frame() -> bytes:
+        if kind == "stepper":
+            return gen.stepper_frame(1)
+        at = started_at + int(gen.frames / rate * 1e9)
+        out = gen.force_frame()
+        sampled_at[gen.seq_num] = at
+        return out
+
+    def produce() -> None:
+        nonlocal producer_cpu
+        cpu_at = time.thread_time()
+        while not stop.is_set():
+            ready = min(int((time.perf_counter_ns() - started_at) * 1e-9 * rate), total)
+            due = ready - gen.frames
+            if due >= batch or (due > 0 and ready == total):
+                sink(b"".join(frame() for _ in range(due)))
+            if gen.frames >= total:
+                break
+            time.sleep(1e-3)
+        producer_cpu = time.thread_time() - cpu_at
+
+    iom = ForceSensorInterface(port) if kind == "force" else StepDriveControl(port)  # type: ignore
+    producer = threading.Thread(target=produce, name="frame_generator", daemon=True)
+    received: set[int] = set()
+    received_count = 0
+    latency = LatencyHistogram()
+    loop = asyncio.get_running_loop()
+    last_rx_at = rx_started_at = loop.time()
+    cpu_at = time.process_time()
+    started_at = time.perf_counter_ns()
+    producer.start()
+    try:
+        while producer.is_alive() or loop.time() - last_rx_at < 0.2:
+            if isinstance(iom, ForceSensorInterface):
+                rd = await iom.read(loop.time() + 0.1)
+                if rd is not None:
+                    received.add(rd.seq_num)
+                    latency.record(rd.stamps.parsed - sampled_at[rd.seq_num])
+            else:
+                rd = await iom.fetch(timeout=0.1)
+            if rd is not None:
+                received_count += 1
+                last_rx_at = loop.time()
+    finally:
+        stop.set()
+        producer.join()
+        host_cpu = time.process_time() - cpu_at - producer_cpu
+        iom.close()
+        if pty_fd is not None:
+            os.close(pty_fd)
+    if kind == "force":
+        lost = len(gen.intact_seq_nums - received)
+    else:
+        lost = max(0, gen.intact - received_count)
+    return StressReport(
+        kind=kind,
+        offered_baud=baud,
+        elapsed=last_rx_at - rx_started_at,
+        frames_sent=gen.frames,
+        frames_intact=gen.intact,
+        frames_received=received_count,
+        frames_lost=lost,
+        seq_gaps_injected=gen.seq_gaps,
+        overrun_bytes=port.overrun_bytes if isinstance(port, MemoryPort) else 0,
+        batch=batch,
+        latency=latency,
+        host_cpu=host_cpu,
+    )
+
+
+@click.command()
+@click.option("--baud", "-b", default=[38_400.0], multiple=True, show_default=True, help="Can be given many times")
+@click.option("--duration", "-d", default=5.0, show_default=True, help="Seconds per rate")
+@click.option("--kind", type=click.Choice(["force", "stepper"]), default=["force"], multiple=True, show_default=True)
+@click.option(
+    "--batch", default=[1], multiple=True, show_default=True, help="Frames per write; can be given many times"
+)
+@click.option("--transport", type=click.Choice(["memory", "pty"]), default="memory", show_default=True)
+@click.option("--noise", default=0.0, show_default=True, help="Mean random bytes between frames")
+@click.option("--crc-error-rate", default=0.0, show_default=True)
+@click.option("--truncation-rate", default=0.0, show_default=True)
+@click.option("--seq-gap-rate", default=0.0, show_default=True)
+def cli(
+    baud: tuple[float, ...],
+    duration: float,
+    kind: tuple[Literal["force", "stepper"], ...],
+    batch: tuple[int, ...],
+    transport: Literal["memory", "pty"],
+    noise: float,
+    crc_error_rate: float,
+    truncation_rate: float,
+    seq_gap_rate: float,
+) -> None:
+    """
+    Stress the parser and the acquisition pipeline with synthetic frames at rates the real devices cannot reach.
+    Every combination of the frame kind, the baud rate, and the batch size is run in turn and reported as a table
+    of the delivered frames per second, the latency, and the host CPU time per frame.
+    """
+    imp = Impairments(
+        noise=noise,
+        crc_error_rate=crc_error_rate,
+        truncation_rate=truncation_rate,
+        seq_gap_rate=seq_gap_rate,
+    )
+    click.echo(StressReport.TABLE_HEADER)
+    for k, b, n in itertools.product(kind, baud, batch):
+        r = asyncio.run(run_stress(b, duration, k, transport, imp, batch=n))
+        _logger.info("%s", r)
+        click.echo(r.table_row())
+
+
+if __name__ == "__main__":
+    logging.basicConfig(level=logging.WARNING, stream=sys.stderr)
+    cli()
@@ -0,0 +1,316 @@
+from __future__ import annotations
+
+import os
+import sys
+import time
+import codecs
+import asyncio
+import logging
+import contextlib
+
+from typing import AsyncIterator, Callable
+
+from step_drive_control import StepDriveControl
+
+_logger = logging.getLogger(__name__)
+
+_KEYS = {
+    "\x1b[A": "up",
+    "\x1bOA": "up",
+    "k": "up",
+    "w": "up",
+    "\x1b[B": "down",
+    "\x1bOB": "down",
+    "j": "down",
+    "s": "down",
+    " ": "stop",
+    "+": "faster",
+    "=": "faster",
+    "-": "slower",
+    "q": "quit",
+}
+
+_ESC = "\x1b"
+
+ESC_TIMEOUT = 0.05
+"""[s] An Esc that no more input follows within this time is the Esc key rather than the start of a sequence."""
+
+HELP = "Hold Up/Down (or k/j) to move, Space to stop, +/- to change the speed, q or Esc to quit"
+
+
+class KeyDecoder:
+    """
+    Decodes the input of a terminal in cbreak mode into jog actions; the keys that have none are dropped.
+    The escape sequences (CSI: Esc [ parameters final, SS3: Esc O char) are recognized whole, so that the keys
+    without an action, e.g., Right or F5, are dropped rather than read as Esc followed by more keys. A sequence cut
+    by the end of a read is kept until the next one. An Esc that nothing follows is the Esc key, but that is only
+    known once the input has paused: then :meth:`flush` is to be invoked.
+
+    >>> dec = KeyDecoder()
+    >>> dec.feed("\\x1b[A\\x1b[Ak x+\\x1b[Bq")
+    ['up', 'up', 'up', 'stop', 'faster', 'down', 'quit']
+    >>> dec.feed("\\x1b[C\\x1b[15~\\x1b[1;5Aj\\x1bOB\\x1bOP")  # Right, F5, Ctrl+Up, j, Down, F1.
+    ['down', 'down']
+    >>> dec.feed("k\\x1b["), dec.pending, dec.feed("A")  # Up, cut in two by the reads.
+    (['up'], True, ['up'])
+    >>> dec.feed("\\x1b"), dec.flush(), dec.pending  # Esc.
+    ([], ['quit'], False)
+    >>> dec.feed("\\x1b["), dec.flush()  # Never completed.
+    ([], [])
+    """
+
+    def __init__(self) -> None:
+        self._pending = ""
+
+    @property
+    def pending(self) -> bool:
+        """Whether the input ends with an incomplete escape sequence or an Esc."""
+        return bool(self._pending)
+
+    def feed(self, chunk: str) -> list[str]:
+        buf = self._pending + chunk
+        out = []
+        i = 0
+        while i < len(buf):
+            if buf[i] != _ESC:
+                if buf[i] in _KEYS:
+                    out.append(_KEYS[buf[i]])
+                i += 1
+                continue
+            end = self._sequence_end(buf, i)
+            if end is None:
+                break
+            if buf[i:end] in _KEYS:
+                out.append(_KEYS[buf[i:end]])
+            i = end
+        self._pending = buf[i:]
+        return out
+
+    def flush(self) -> list[str]:
+        """To be invoked once the input has paused: a lone Esc is the Esc key, an incomplete sequence is dropped."""
+        out = ["quit"] if self._pending == _ESC else []
+        self._pending = ""
+        return out
+
+    @staticmethod
+    def _sequence_end(buf: str, i: int) -> int | None:
+        """The end of the escape sequence at ``i``, or None if the input ends before it does."""
+        if i + 1 >= len(buf):
+            return None
+        intro = buf[i + 1]
+        if intro == "O":  # SS3: one more character.
+            return i + 3 if i + 2 < len(buf) else None
+        if intro != "[":  # Alt with a key.
+            return i + 2
+        for k in range(i + 2, len(buf)):  # CSI: parameter and intermediate bytes up to the final byte.
+            if "\x40" <= buf[k] <= "\x7e":
+                return k + 1
+        return None
+
+
+class JogState:
+    """
+    The hold-to-move logic of the jog, apart from the terminal and the port. All times are time.monotonic().
+
+    A terminal reports no key releases, only the auto-repeat of the held key, so the key is taken as released
+    once the repeats stop for ``repeat_hold``. The first repeat comes only after the repeat delay of the terminal,
+    so until then the hold lasts ``first_hold``; a single tap therefore moves the arm that long.
+
+    The drive runs at one speed; the lower jog speeds move for a fraction of every ``period`` and stop for the rest.
+
+    The position is integrated from the steps the drive reports, so it is what the arm has actually done, in seconds
+    of travel from the start of the jog, downwards positive like :attr:`trial_protocol.RigState.position`.
+
+    >>> jog = JogState(first_hold=0.5, repeat_hold=0.1, period=0.2)
+    >>> jog.press("DOWN", 0.0)
+    >>> jog.desired(0.4), jog.desired(0.6)  # The tap has expired.
+    ('DOWN', 'STOP')
+    >>> for t in (1.0, 1.45, 1.55, 1.6):  # Held: the repeats keep it moving until they stop.
+    ...     jog.press("UP", t)
+    >>> jog.desired(1.65), jog.desired(1.75)
+    ('UP', 'STOP')
+    >>> jog.slower()
+    >>> jog.speed
+    0.5
+    >>> jog.press("UP", 2.0)
+    >>> [jog.desired(t) for t in (2.05, 2.15, 2.25, 2.35)]
+    ['UP', 'STOP', 'UP', 'STOP']
+    >>> jog.press("UP", 2.4)
+    >>> jog.release()
+    >>> jog.desired(2.41)
+    'STOP'
+    >>> for t, step in [(0.0, 1), (0.5, -1), (0.7, 0), (1.0, 0)]:
+    ...     jog.report(step, t)
+    >>> round(jog.position, 3), jog.reported
+    (0.3, 'STOP')
+    """
+
+    SPEEDS = (1.0, 0.5, 0.25, 0.1)
+
+    def __init__(self, first_hold: float = 0.5, repeat_hold: float = 0.1, period: float = 0.2) -> None:
+        self.first_hold = first_hold
+        self.repeat_hold = repeat_hold
+        self.period = period
+        self.direction: str | None = None
+        self.position = 0.0
+        self.reported = "STOP"
+        self._speed_index = 0
+        self._pressed_at = 0.0
+        self._held_until = 0.0
+        self._last_report: tuple[float, int] | None = None
+
+    @property
+    def speed(self) -> float:
+        return self.SPEEDS[self._speed_index]
+
+    def faster(self) -> None:
+        self._speed_index = max(0, self._speed_index - 1)
+
+    def slower(self) -> None:
+        self._speed_index = min(len(self.SPEEDS) - 1, self._speed_index + 1)
+
+    def press(self, direction: str, now: float) -> None:
+        if self.direction != direction or now > self._held_until:
+            self.direction, self._pressed_at = direction, now
+            self._held_until = now + self.first_hold
+        else:
+            self._held_until = max(self._held_until, now + self.repeat_hold)
+
+    def release(self) -> None:
+        self.direction = None
+
+    def desired(self, now: float) -> str:
+        """The command the drive should be executing now."""
+        if self.direction is None or now > self._held_until:
+            self.direction = None
+            return "STOP"
+        if (now - self._pressed_at) % self.period >= self.speed * self.period:
+            return "STOP"
+        return self.direction
+
+    def report(self, step: int, now: float) -> None:
+        """A step report from the drive, see :class:`StepDriveControl`."""
+        if self._last_report is not None:
+            at, last = self._last_report
+            self.position += last * (now - at)
+        self._last_report = now, step
+        self.reported = StepDriveControl.step_to_direction(step)
+
+    def readout(self) -> str:
+        moving = self.direction or "STOP"
+        return f"{moving:<5} speed {self.speed:>4.0%}   position {self.position:+8.3f} s   drive {self.reported:<5}"
+
+
+async def run_jog(
+    drive: StepDriveControl,
+    keys: asyncio.Queue[str],
+    show: Callable[[str], None] = lambda s: None,
+    state: JogState | None = None,
+    tick: float = 0.01,
+    resend: float = 0.05,
+    refresh: float = 0.05,
+) -> JogState:
+    """
+    Runs the jog on one open connection until the "quit" action arrives in ``keys``, then stops the drive
+    and waits for it to confirm. The actions are those of :class:`KeyDecoder`.
+
+    Every change of the desired command is sent at once without waiting for the confirmation, which would take
+    longer than the shortest move; instead, the command is resent if the reports still disagree with it
+    ``resend`` seconds later. The readout is passed to ``show`` every ``refresh`` seconds.
+
+    >>> from reaction_benchmark import SimulatedDevices
+    >>> dev = SimulatedDevices(report_period=0.01)
+    >>> dev.start()
+    >>> async def operator(keys):
+    ...     for _ in range(10):  # Held down for half a second.
+    ...         keys.put_nowait("down")
+    ...         await asyncio.sleep(0.05)
+    ...     await asyncio.sleep(0.3)
+    ...     keys.put_nowait("quit")
+    >>> async def test():
+    ...     drive = StepDriveControl(dev.drive_link.port, event_driven=True, confirm="ack")
+    ...     keys = asyncio.Queue()
+    ...     _, state = await asyncio.gather(operator(keys), run_jog(drive, keys))
+    ...     drive.close()
+    ...     return state
+    >>> state = asyncio.run(test())
+    >>> dev.stop()
+    >>> [step for _, step in dev.commands][:2], dev.commands[-1][1]
+    ([1, 0], 0)
+    >>> state.position > 0, state.direction
+    (True, None)
+    """
+    state = state if state is not None else JogState()
+    sent: str | None = None
+    sent_at = shown_at = 0.0
+    try:
+        while True:
+            now = time.monotonic()
+            while not keys.empty():
+                action = keys.get_nowait()
+                if action == "quit":
+                    return state
+                if action in ("up", "down"):
+                    state.press(action.upper(), now)
+                elif action == "stop":
+                    state.release()
+                elif action == "faster":
+                    state.faster()
+                elif action == "slower":
+                    state.slower()
+            want = state.desired(now)
+            if want != sent or (state.reported != want and now - sent_at > resend):
+                if sent == want:
+                    _logger.debug("Resending %s, the drive still reports %s", want, state.reported)
+                await drive.command_unconfirmed(want)
+                sent, sent_at = want, now
+            if now - shown_at >= refresh:
+                show(state.readout())
+                shown_at = now
+            if (rd := await drive.fetch(timeout=tick)) is not None:
+                state.report(int(rd.step), time.monotonic())
+    finally:
+        await drive.stop()
+        show(state.readout())
+
+
+@contextlib.asynccontextmanager
+async def terminal_keys() -> AsyncIterator[asyncio.Queue[str]]:
+    """
+    Puts the terminal into cbreak mode (no line buffering, no echo) and yields a queue of the jog actions of the keys
+    pressed; the terminal is restored on exit. POSIX only.
+    """
+    import tty  # pylint: disable=import-outside-toplevel
+    import termios  # pylint: disable=import-outside-toplevel
+
+    fd = sys.stdin.fileno()
+    if not os.isatty(fd):
+        raise RuntimeError("The jog needs an interactive terminal")
+    saved = termios.tcgetattr(fd)
+    keys: asyncio.Queue[str] = asyncio.Queue()
+    loop = asyncio.get_running_loop()
+    decoder = KeyDecoder()
+    utf8 = codecs.getincrementaldecoder("utf-8")(errors="replace")
+    pause: asyncio.TimerHandle | None = None
+
+    def put(actions: list[str]) -> None:
+        for action in actions:
+            keys.put_nowait(action)
+
+    def on_input() -> None:
+        nonlocal pause
+        if pause is not None:
+            pause.cancel()
+        put(decoder.feed(utf8.decode(os.read(fd, 64))))
+        # The rest of an escape sequence arrives at once; if nothing follows soon, it was the Esc key.
+        pause = loop.call_later(ESC_TIMEOUT, lambda: put(decoder.flush())) if decoder.pending else None
+
+    tty.setcbreak(fd)
+    loop.add_reader(fd, on_input)
+    try:
+        yield keys
+    finally:
+        loop.remove_reader(fd)
+        if pause is not None:
+            pause.cancel()
+        termios.tcsetattr(fd, termios.TCSADRAIN, saved)
@@ -0,0 +1,175 @@
+from __future__ import annotations
+
+import json
+import time
+import dataclasses
+from pathlib import Path
+from typing import Any
+
+
+class LatencyHistogram:
+    """
+    An HDR-style histogram of non-negative integer values (nanoseconds): the buckets are linear within each power
+    of two, so the relative error is bounded by 2**-SUB_BUCKET_BITS over the whole range, with a constant cost
+    per record and memory that grows only logarithmically with the largest value.
+
+    >>> h = LatencyHistogram()
+    >>> for v in range(1, 1001):
+    ...     h.record(v * 1000)
+    >>> h.count, h.min, h.max
+    (1000, 1000, 1000000)
+    >>> abs(h.percentile(50) - 500_000) / 500_000 < 2**-LatencyHistogram.SUB_BUCKET_BITS
+    True
+    >>> abs(h.percentile(99) - 990_000) / 990_000 < 2**-LatencyHistogram.SUB_BUCKET_BITS
+    True
+    >>> h.percentile(100) == h.max, h.percentile(0) == h.min
+    (True, True)
+    >>> LatencyHistogram().percentile(50)
+    0
+    """
+
+    SUB_BUCKET_BITS = 5
+    _SUB = 1 << SUB_BUCKET_BITS
+    _HALF = _SUB // 2
+
+    def __init__(self) -> None:
+        self._counts: list[int] = []
+        self.count = 0
+        self.total = 0
+        self.min = 0
+        self.max = 0
+
+    def record(self, value: int) -> None:
+        value = max(0, value)
+        shift = value.bit_length() - self.SUB_BUCKET_BITS
+        idx = value if shift <= 0 else self._SUB + (shift - 1) * self._HALF + (value >> shift) - self._HALF
+        if idx >= len(self._counts):
+            self._counts.extend([0] * (idx + 1 - len(self._counts)))
+        self._counts[idx] += 1
+        if self.count == 0 or value < self.min:
+            self.min = value
+        if value > self.max:
+            self.max = value
+        self.count += 1
+        self.total += value
+
+    @property
+    def mean(self) -> float:
+        return self.total / self.count if self.count else 0.0
+
+    def percentile(self, p: float) -> int:
+        """The value at the percentile (0..100), reported as the midpoint of its bucket, clamped to [min, max]."""
+        if self.count == 0:
+            return 0
+        if p <= 0:
+            return self.min
+        if p >= 100:
+            return self.max
+        rank = max(1, int(round(p / 100 * self.count)))
+        acc = 0
+        for idx, n in enumerate(self._counts):
+            acc += n
+            if acc >= rank:
+                lo, width = self._bucket(idx)
+                return min(self.max, max(self.min, lo + width // 2))
+        return self.max
+
+    def merge(self, other: LatencyHistogram) -> None:
+        if len(other._counts) > len(self._counts):
+            self._counts.extend([0] * (len(other._counts) - len(self._counts)))
+        for idx, n in enumerate(other._counts):
+            self._counts[idx] += n
+        if other.count:
+            self.min = min(self.min, other.min) if self.count else other.min
+            self.max = max(self.max, other.max)
+        self.count += other.count
+        self.total += other.total
+
+    def to_dict(self) -> dict[str, Any]:
+        buckets = [(self._bucket(i)[0], n) for i, n in enumerate(self._counts) if n]
+        return {
+            "count": self.count,
+            "min": self.min,
+            "max": self.max,
+            "mean": self.mean,
+            "percentiles": {str(p): self.percentile(p) for p in (50, 90, 99, 99.9)},
+            "buckets": buckets,
+        }
+
+    @classmethod
+    def _bucket(cls, idx: int) -> tuple[int, int]:
+        """Lower bound and width of the bucket."""
+        if idx < cls._SUB:
+            return idx, 1
+        shift = (idx - cls._SUB) // cls._HALF + 1
+        return ((idx - cls._SUB) % cls._HALF + cls._HALF) << shift, 1 << shift
+
+
+@dataclasses.dataclass
+class StageTimestamps:
+    """
+    The moments (time.perf_counter_ns) a sample passed through the host side of the acquisition pipeline.
+    The digitizer does not timestamp its conversions, so the pipeline is observed from the moment
+    the sample could have arrived into the OS buffer, which is bounded by the previous poll of the port.
+    """
+
+    polled: int = 0
+    """When the previous read of the port started; the bytes arrived into the OS buffer after this."""
+    received: int = 0
+    """When the read that returned the bytes of the sample completed."""
+    parsed: int = 0
+    calibrated: int = 0
+    decided: int = 0
+
+
+class LatencyProfile:
+    """
+    Aggregates the per-stage latencies of the samples into a histogram per stage.
+    The UART stage is not measured but computed from the frame size and the baud rate (10 bits per byte),
+    so that it can be compared against the rest.
+
+    >>> lp = LatencyProfile(frame_size=90, baud=38400)
+    >>> lp.add(StageTimestamps(polled=0, received=1_000_000, parsed=1_050_000, calibrated=1_100_000, decided=1_300_000))
+    >>> {k: v.percentile(50) for k, v in lp.histograms.items()}  # doctest: +NORMALIZE_WHITESPACE
+    {'uart': 23437500, 'os_buffer_and_polling': 1000000, 'parsing': 50000, 'calibration': 50000,
+     'decision': 200000, 'host_total': 1300000}
+    >>> print(lp.report())  # doctest: +NORMALIZE_WHITESPACE
+    stage                     count     p50 [ms]     p90 [ms]     p99 [ms]     max [ms]
+    uart                          1       23.438       23.438       23.438       23.438
+    os_buffer_and_polling         1        1.000        1.000        1.000        1.000
+    parsing                       1        0.050        0.050        0.050        0.050
+    calibration                   1        0.050        0.050        0.050        0.050
+    decision                      1        0.200        0.200        0.200        0.200
+    host_total                    1        1.300        1.300        1.300        1.300
+    """
+
+    STAGES = ("uart", "os_buffer_and_polling", "parsing", "calibration", "decision", "host_total")
+
+    def __init__(self, frame_size: int, baud: int) -> None:
+        self._uart_ns = int(frame_size * 10 * 1e9 / baud)
+        self.histograms = {s: LatencyHistogram() for s in self.STAGES}
+
+    def add(self, ts: StageTimestamps) -> None:
+        h = self.histograms
+        h["uart"].record(self._uart_ns)
+        h["os_buffer_and_polling"].record(ts.received - ts.polled)
+        h["parsing"].record(ts.parsed - ts.received)
+        if ts.calibrated:
+            h["calibration"].record(ts.calibrated - ts.parsed)
+            if ts.decided:
+                h["decision"].record(ts.decided - ts.calibrated)
+        h["host_total"].record((ts.decided or ts.calibrated or ts.parsed) - ts.polled)
+
+    def report(self) -> str:
+        lines = [
+            f"{'stage':<22}{'count':>9}" + "".join(f"{c:>13}" for c in ("p50 [ms]", "p90 [ms]", "p99 [ms]", "max [ms]"))
+        ]
+        for name, h in self.histograms.items():
+            vals = [h.percentile(50), h.percentile(90), h.percentile(99), h.max]
+            lines.append(f"{name:<22}{h.count:>9}" + "".join(f"{v * 1e-6:>13.3f}" for v in vals))
+        return "\n".join(lines)
+
+    def export(self, path: str | Path) -> None:
+        """Writes the histograms as JSON; the values are in nanoseconds."""
+        doc = {"created": time.time(), "unit": "ns", "stages": {k: v.to_dict() for k, v in self.histograms.items()}}
+        Path(path).write_text(json.dumps(doc, indent=1))
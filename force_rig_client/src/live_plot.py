@@ -0,0 +1,210 @@
+from __future__ import annotations
+
+import time
+import asyncio
+import logging
+import numpy as np
+
+from collections import deque
+from typing import Mapping
+from numpy.typing import NDArray
+from matplotlib import pyplot
+from matplotlib.figure import Figure
+
+from latency_profile import LatencyHistogram
+from downsampling import lttb
+
+_logger = logging.getLogger(__name__)
+
+
+class SampleBuffer:
+    """
+    A fixed-capacity ring of the latest force samples and the labelled events, written by the acquisition loop
+    at the cost of two array stores per sample and read by the plot at its own pace.
+
+    >>> b = SampleBuffer(4)
+    >>> for i in range(6):
+    ...     b.append(float(i), i * 10.0)
+    >>> t, f = b.snapshot()
+    >>> t.tolist(), f.tolist(), b.count
+    ([2.0, 3.0, 4.0, 5.0], [20.0, 30.0, 40.0, 50.0], 6)
+    >>> b.snapshot(since=3.5)[1].tolist()
+    [40.0, 50.0]
+    >>> b.mark("contact", 3.5)
+    >>> list(b.markers)
+    [(3.5, 'contact')]
+    """
+
+    MAX_MARKERS = 64
+
+    def __init__(self, capacity: int = 1 << 15) -> None:
+        self._t = np.zeros(capacity)
+        self._f = np.zeros(capacity)
+        self._count = 0
+        self.markers: deque[tuple[float, str]] = deque(maxlen=self.MAX_MARKERS)
+
+    @property
+    def count(self) -> int:
+        """Samples appended so far, including those already overwritten."""
+        return self._count
+
+    def append(self, t: float, f: float) -> None:
+        i = self._count % len(self._t)
+        self._t[i] = t
+        self._f[i] = f
+        self._count += 1
+
+    def mark(self, label: str, t: float) -> None:
+        self.markers.append((t, label))
+
+    def snapshot(self, since: float | None = None) -> tuple[NDArray[np.float64], NDArray[np.float64]]:
+        """Copies of the buffered samples in the order of arrival, optionally only those at or after ``since``."""
+        cap = len(self._t)
+        if self._count <= cap:
+            t, f = self._t[: self._count].copy(), self._f[: self._count].copy()
+        else:
+            i = self._count % cap
+            t, f = np.roll(self._t, -i), np.roll(self._f, -i)
+        if since is not None:
+            k = int(np.searchsorted(t, since))
+            t, f = t[k:], f[k:]
+        return t, f
+
+
+class LivePlot:
+    """
+    A live force plot that scrolls over the last ``window`` seconds, redrawn at ``fps`` from a :class:`SampleBuffer`.
+    It runs as a task on the event loop of the acquisition, so every frame is time taken from it; the frames are
+    therefore cheap by construction and their cost is bounded:
+
+    - The axes, the grid, and the threshold lines are drawn once into a background that is blitted back each frame;
+      only the force line and the event markers are drawn anew. The time axis is relative to now, so the background
+      stays valid while the plot scrolls; it is redrawn only if the force leaves the vertical range.
+    - The samples are reduced to ``max_points`` by :func:`downsampling.lttb`, so the cost does not grow with
+      the sample rate.
+    - The cost of each frame is recorded in :attr:`render_cost`. If a frame exceeds ``budget`` seconds, the point
+      count is halved; it is doubled back while the frames take less than a quarter of the budget.
+      The frames that redraw the background are recorded but do not count, as they are rare and cost the same anyway.
+      The task sleeps at least as long as the last frame took, so it never takes more than half of the loop.
+
+    >>> from matplotlib.backends.backend_agg import FigureCanvasAgg
+    >>> fig = Figure()
+    >>> _ = FigureCanvasAgg(fig)
+    >>> buf = SampleBuffer()
+    >>> for i in range(5000):
+    ...     buf.append(i * 0.01, 5 * np.sin(i * 0.01))
+    >>> buf.mark("contact", 35.0)
+    >>> buf.mark("detachment", 10.0)  # Out of the window.
+    >>> plot = LivePlot(buf, thresholds={"max force": 15.0}, figure=fig)
+    >>> _ = plot.render(now=50.0)
+    >>> len(plot.line.get_xdata()) <= plot.max_points, min(plot.line.get_xdata()) >= -plot.window
+    (True, True)
+    >>> [(m.get_xdata()[0], m.get_label()) for m in plot.visible_markers]
+    [(-15.0, 'contact')]
+    >>> plot.budget = 0.0  # Nothing fits, so the resolution is shed.
+    >>> _ = plot.render(now=50.0)
+    >>> plot.max_points, plot.render_cost.count
+    (500, 2)
+    """
+
+    MIN_POINTS = 100
+    MARKER_COLORS = {"contact": "tab:green", "detachment": "tab:red"}
+
+    def __init__(
+        self,
+        buffer: SampleBuffer,
+        window: float = 30.0,
+        fps: float = 10.0,
+        thresholds: Mapping[str, float] | None = None,
+        ylim: tuple[float, float] = (-2.0, 16.0),
+        max_points: int = 1000,
+        budget: float = 0.02,
+        figure: Figure | None = None,
+    ) -> None:
+        self._buffer = buffer
+        self.window = window
+        self.period = 1.0 / fps
+        self.max_points = max_points
+        self._points_limit = max_points
+        self.budget = budget
+        self.render_cost = LatencyHistogram()
+        """[ns] Per frame."""
+        self.fig = figure if figure is not None else pyplot.figure(figsize=(10, 4))
+        self.ax = self.fig.add_subplot()
+        self.ax.set_xlim(-window, 0)
+        self.ax.set_ylim(*ylim)
+        self.ax.set_xlabel("Time [s]")
+        self.ax.set_ylabel("Force [N]")
+        self.ax.grid(True)
+        for i, (name, value) in enumerate((thresholds or {}).items()):
+            self.ax.axhline(value, color=f"C{i + 1}", linestyle="--", linewidth=1, label=name)
+        (self.line,) = self.ax.plot([], [], color="tab:blue", linewidth=1, animated=True, label="force")
+        self._markers: list = []
+        self.visible_markers: list = []
+        self._background = None
+        self.fig.canvas.mpl_connect("draw_event", self._capture_background)
+
+    def _capture_background(self, _event: object = None) -> None:
+        self._background = self.fig.canvas.copy_from_bbox(self.fig.bbox)  # type: ignore[attr-defined]
+
+    def _redraw_background(self) -> None:
+        self.ax.legend(loc="upper left", fontsize=8)
+        self.fig.canvas.draw()  # Fires the draw event, which captures the background without the animated artists.
+
+    def render(self, now: float | None = None) -> float:
+        """Draws one frame and returns its cost [s]. ``now`` defaults to time.monotonic(), the clock of the runner."""
+        started_at = time.perf_counter()
+        now = time.monotonic() if now is None else now
+        t, f = self._buffer.snapshot(since=now - self.window)
+        t, f = lttb(t, f, self.max_points - 2)  # It adds the extremes.
+        lo, hi = self.ax.get_ylim()
+        if len(f) and (f.max() > hi or f.min() < lo):
+            margin = 0.1 * (max(hi, f.max()) - min(lo, f.min()))
+            self.ax.set_ylim(min(lo, f.min() - margin), max(hi, f.max() + margin))
+            self._background = None
+        redrawn = self._background is None
+        if redrawn:
+            self._redraw_background()
+        canvas = self.fig.canvas
+        canvas.restore_region(self._background)  # type: ignore[attr-defined]
+        self.line.set_data(t - now, f)
+        self.ax.draw_artist(self.line)
+        self.visible_markers = []
+        for at, label in self._buffer.markers:
+            if at >= now - self.window:
+                m = self._marker(len(self.visible_markers))
+                m.set_xdata([at - now, at - now])
+                m.set_color(self.MARKER_COLORS.get(label, "black"))
+                m.set_label(label)
+                self.ax.draw_artist(m)
+                self.visible_markers.append(m)
+        canvas.blit(self.fig.bbox)
+        canvas.flush_events()
+        cost = time.perf_counter() - started_at
+        self.render_cost.record(int(cost * 1e9))
+        if not redrawn:  # A full redraw is rare and its cost does not depend on the point count.
+            if cost > self.budget and self.max_points > self.MIN_POINTS:
+                self.max_points = max(self.MIN_POINTS, self.max_points // 2)
+                _logger.info("Live plot frame took %.1f ms, reduced to %d points", cost * 1e3, self.max_points)
+            elif cost < self.budget / 4 and self.max_points < self._points_limit:
+                self.max_points = min(self._points_limit, self.max_points * 2)
+        return cost
+
+    def _marker(self, index: int):  # type: ignore[no-untyped-def]
+        while len(self._markers) <= index:
+            self._markers.append(self.ax.axvline(0, linestyle=":", linewidth=1.5, animated=True))
+        return self._markers[index]
+
+    async def run(self) -> None:
+        """Renders at the frame rate until cancelled."""
+        self.fig.show()
+        while True:
+            cost = self.render()
+            await asyncio.sleep(max(self.period - cost, cost))
+
+    def report(self) -> str:
+        h = self.render_cost
+        return (
+            f"Live plot: {h.count} frames, render p50 {h.percentile(50) * 1e-6:.1f} ms, "
+            f"p99 {h.percentile(99) * 1e-6:.1f} ms, max {h.max * 1e-6:.1f} ms, {self.max_points} points"
+        )
@@ -0,0 +1,112 @@
+from __future__ import annotations
+
+import dataclasses
+import numpy as np
+from numpy.typing import ArrayLike
+
+
+@dataclasses.dataclass(frozen=True)
+class PeakEstimate:
+    """
+    The true peak of a sampled force trace, estimated between the samples.
+    """
+
+    force: float
+    """Estimated true peak force [N]."""
+    sigma: float
+    """One-sigma uncertainty of the estimated peak force [N]."""
+    time: float
+    """Estimated time of the peak, same units as the timestamps."""
+    sampled: float
+    """The largest sample, which is what the naive max() would report."""
+    detached: bool
+    """True if the peak ends with a detachment cliff rather than a smooth maximum."""
+
+
+def estimate_peak(
+    t: ArrayLike,
+    f: ArrayLike,
+    window: int = 5,
+    cliff: float = 0.5,
+    noise_sigma: float | None = None,
+) -> PeakEstimate:
+    """
+    At low sample rates the largest sample can be noticeably below the true peak, by an amount that depends on the
+    pull speed and on where the samples land. This estimator fits a quadratic in time to the samples around the
+    sampled maximum and recovers the peak between the samples. Two shapes are distinguished:
+
+    - If the force drops by more than ``cliff`` (a fraction of the peak) right after the maximum, the plate has
+      detached somewhere between the maximum and the next sample. The rising segment up to the maximum is fitted
+      and extrapolated over that interval; the estimate is the mean of the extrapolation, and the uncertainty
+      includes the spread due to the unknown detachment instant.
+    - Otherwise the vertex of a quadratic fitted around the maximum is taken.
+
+    ``window`` is the number of samples used for the fit. If ``noise_sigma`` (per sample) is not given,
+    it is estimated from the fit residuals.
+
+    Rising at 10 N/s sampled at 10 Hz, detaching at 0.97 s at 9.7 N; max() would report 9.0 N:
+
+    >>> t = np.arange(0, 1.5, 0.1)
+    >>> f = np.where(t < 0.97, 10 * t, 0.3)
+    >>> pk = estimate_peak(t, f, noise_sigma=0.01)
+    >>> pk.detached, round(pk.sampled, 3), round(pk.force, 3), round(pk.sigma, 3)
+    (True, 9.0, 9.5, 0.289)
+
+    A smooth maximum at 0.42 s between the samples is recovered from the vertex:
+
+    >>> f = 5 - (t - 0.42) ** 2
+    >>> pk = estimate_peak(t, f)
+    >>> pk.detached, round(pk.force, 6), round(pk.time, 6), pk.force > pk.sampled
+    (False, 5.0, 0.42, True)
+
+    Degenerate inputs fall back to the largest sample:
+
+    >>> estimate_peak([0.0], [3.0])
+    PeakEstimate(force=3.0, sigma=0.0, time=0.0, sampled=3.0, detached=False)
+    """
+    t = np.asarray(t, dtype=np.float64)
+    f = np.asarray(f, dtype=np.float64)
+    if t.shape != f.shape or t.ndim != 1 or len(t) == 0:
+        raise ValueError(f"Timestamps and forces must be non-empty 1D arrays of equal size: {t.shape} {f.shape}")
+    i = int(np.argmax(f))
+    sampled = float(f[i])
+    fallback = PeakEstimate(force=sampled, sigma=0.0, time=float(t[i]), sampled=sampled, detached=False)
+    detached = i + 1 < len(f) and (f[i] - f[i + 1]) > cliff * abs(f[i])
+    if detached:
+        lo, hi = max(0, i - window + 1), i + 1
+    else:
+        lo = max(0, min(i - window // 2, len(f) - window))
+        hi = min(len(f), lo + window)
+    if hi - lo < 3:
+        return fallback
+
+    # Fit around the maximum in local time to keep the normal equations well-conditioned.
+    x, y = t[lo:hi] - t[i], f[lo:hi]
+    a = np.vander(x, 3)
+    coef, *_ = np.linalg.lstsq(a, y, rcond=None)
+    dof = len(x) - 3
+    if noise_sigma is None:
+        noise_sigma = float(np.sqrt(np.sum((a @ coef - y) ** 2) / dof)) if dof > 0 else 0.0
+    cov = noise_sigma**2 * np.linalg.pinv(a.T @ a)
+    c2, c1, c0 = coef
+
+    if detached:
+        # The detachment instant is uniformly distributed between the maximum and the next sample.
+        # Average the fitted curve over that interval: the mean of the quadratic is exact in closed form.
+        h = float(t[i + 1] - t[i])
+        grad = np.array([h**2 / 3, h / 2, 1.0])
+        force = float(grad @ coef)
+        # The spread of the curve over the interval, approximated as linear, is uniform.
+        spread = abs(c1 + c2 * h) * h / np.sqrt(12)
+        sigma = float(np.sqrt(grad @ cov @ grad + spread**2))
+        return PeakEstimate(force=force, sigma=sigma, time=float(t[i]) + h / 2, sampled=sampled, detached=True)
+
+    if c2 >= 0:
+        return fallback  # Not a maximum.
+    x_peak = -c1 / (2 * c2)
+    if not x[0] <= x_peak <= x[-1]:
+        return fallback  # The vertex is outside the fitted data, extrapolation is not trustworthy.
+    force = float(c0 - c1**2 / (4 * c2))
+    grad = np.array([c1**2 / (4 * c2**2), -c1 / (2 * c2), 1.0])
+    sigma = float(np.sqrt(max(0.0, grad @ cov @ grad)))
+    return PeakEstimate(force=force, sigma=sigma, time=float(t[i] + x_peak), sampled=sampled, detached=False)
@@ -0,0 +1,194 @@
+from __future__ import annotations
+
+import logging
+import dataclasses
+import numpy as np
+from typing import Any, Iterable, Mapping
+from numpy.typing import ArrayLike, NDArray
+
+from surrogate import SparseGaussianProcess
+from trace_archive import TraceArchive
+from trial_protocol import Detector, Predicate
+
+_logger = logging.getLogger(__name__)
+
+
+@dataclasses.dataclass(frozen=True)
+class PeakPrediction:
+    """
+    The peak force a pull will eventually reach, predicted from its rising segment.
+    """
+
+    force: float
+    """Predicted peak force [N]; never below what has already been observed."""
+    sigma: float
+    """One-sigma uncertainty of the prediction [N], including the trial-to-trial scatter."""
+    observed: float
+    """The largest force of the rising segment so far [N]."""
+    elapsed: float
+    """Time since the onset of the pull, same units as the timestamps."""
+
+    def bound(self, z: float = 2.0) -> tuple[float, float]:
+        """The confidence interval of ``z`` sigmas, clipped below at the observed force."""
+        return max(self.observed, self.force - z * self.sigma), self.force + z * self.sigma
+
+
+class PeakPredictor:
+    """
+    Predicts the peak of a pull from its beginning, so that a screening trial can stop pulling long before the plate
+    detaches. The force rises along a repeatable curve whose shape depends on how strongly the plate is held, so the
+    remaining rise is a smooth function of the time since the onset, the current force, and the current slope.
+    That function is learned from completed traces with a :class:`surrogate.SparseGaussianProcess`, which also
+    provides the confidence of each prediction; every sample of the rising segment of each trace is a training point.
+
+    Synthetic pulls that approach their peak exponentially and detach at 95% of it:
+
+    >>> def pull(peak, rate=20.0):
+    ...     t = np.arange(0, 4, 1 / rate)
+    ...     f = np.where(t < 0.5, 0.0, peak * (1 - np.exp(-(t - 0.5) / 0.6)))
+    ...     return t, np.where(np.cumsum(f > 0.95 * peak) > 0, 0.0, f)
+    >>> training = [(*pull(p), p * 0.95) for p in np.linspace(2, 12, 15)]
+    >>> pp = PeakPredictor().fit(training)
+    >>> pp.training_points > 100
+    True
+    >>> t, f = pull(7.3)
+    >>> early = t < 1.0  # Half a second into a pull that lasts about two.
+    >>> p = pp.predict(t[early], f[early])
+    >>> round(p.observed, 1), abs(p.force - 7.3 * 0.95) < 0.1, p.sigma < 0.5
+    (3.9, True, True)
+    >>> pp.predict([0, 0.1], [0.0, 0.1]) is None  # The pull has not started.
+    True
+    """
+
+    def __init__(
+        self,
+        onset_threshold: float = 0.3,
+        detach_threshold: float = 0.5,
+        slope_window: int = 5,
+        n_inducing: int = 64,
+        random_state: int | None = 0,
+    ) -> None:
+        self.onset_threshold = onset_threshold
+        self.detach_threshold = detach_threshold
+        self.slope_window = slope_window
+        self._model = SparseGaussianProcess(n_inducing=n_inducing, random_state=random_state)
+        self._noise_std = 0.0
+        self.training_points = 0
+        self.training_traces = 0
+
+    @classmethod
+    def from_archive(
+        cls,
+        archive: TraceArchive,
+        config: Mapping[str, Any],
+        min_traces: int = 10,
+        **kwargs: Any,
+    ) -> PeakPredictor | None:
+        """
+        Fits the predictor on the completed trials archived under the given rig configuration.
+        Returns None if there are fewer than ``min_traces`` of them.
+        """
+        ids = archive.find(config=config)
+        ids = ids[~np.isnan(archive.index["peak"][ids])]
+        if len(ids) < min_traces:
+            _logger.info("Only %d completed traces under %s, not enough to predict the peaks", len(ids), config)
+            return None
+        traces = []
+        for i in ids:
+            tr = archive.read(int(i))
+            traces.append((tr.columns["t"], tr.columns["f"], tr.peak))
+        return cls(**kwargs).fit(traces)
+
+    def fit(self, traces: Iterable[tuple[ArrayLike, ArrayLike, float]]) -> PeakPredictor:
+        """Fits on the (timestamps, forces, peak) of completed pulls."""
+        xs: list[NDArray[np.float64]] = []
+        ys: list[NDArray[np.float64]] = []
+        self.training_traces = 0
+        for t, f, peak in traces:
+            t, f = np.asarray(t, dtype=np.float64), np.asarray(f, dtype=np.float64)
+            seg = self._rising_segment(f)
+            if seg is None or not np.isfinite(peak):
+                continue
+            onset, end = seg
+            rows = [self._features(t[: k + 1], f[: k + 1], onset) for k in range(onset + 1, end + 1)]
+            if not rows:
+                continue
+            x = np.array(rows)
+            xs.append(x)
+            ys.append(peak - x[:, 1])
+            self.training_traces += 1
+        if not xs:
+            raise ValueError("No usable traces: none has a rising segment")
+        x, y = np.concatenate(xs), np.concatenate(ys)
+        self._model.fit(x, y)
+        self._noise_std = float(np.sqrt(self._model.noise_)) * self._model.y_scale_
+        self.training_points = len(x)
+        _logger.info("Peak predictor fitted on %d points from %d traces", len(x), self.training_traces)
+        return self
+
+    def predict(self, t: ArrayLike, f: ArrayLike, onset: int | None = None) -> PeakPrediction | None:
+        """
+        Predicts the peak from the trace so far. Returns None until the pull has started.
+        The onset index can be given if it is already known, which saves the search in a live loop.
+        """
+        t, f = np.asarray(t, dtype=np.float64), np.asarray(f, dtype=np.float64)
+        if onset is None:
+            above = np.flatnonzero(f > self.onset_threshold)
+            if len(above) == 0:
+                return None
+            onset = int(above[0])
+        if len(f) - onset < 2:
+            return None
+        x = self._features(t, f, onset)
+        mean, std = self._model.predict(x[None, :], return_std=True)
+        observed = float(np.max(f[onset:]))
+        return PeakPrediction(
+            force=max(observed, float(x[1] + mean[0])),
+            sigma=float(np.hypot(std[0], self._noise_std)),
+            observed=observed,
+            elapsed=float(t[-1] - t[onset]),
+        )
+
+    def _features(self, t: NDArray[np.float64], f: NDArray[np.float64], onset: int) -> NDArray[np.float64]:
+        lo = max(onset, len(f) - self.slope_window)
+        slope = float(np.polyfit(t[lo:], f[lo:], 1)[0]) if len(f) - lo >= 2 else 0.0
+        return np.array([t[-1] - t[onset], f[-1], slope])
+
+    def _rising_segment(self, f: NDArray[np.float64]) -> tuple[int, int] | None:
+        """From the onset to the last sample before the detachment, like :func:`cycle_metrics.compute_cycle_metrics`."""
+        above = np.flatnonzero(f > self.onset_threshold)
+        if len(above) == 0:
+            return None
+        onset = int(above[0])
+        drops = np.flatnonzero(-np.diff(f) > self.detach_threshold)
+        drops = drops[drops >= onset]
+        end = int(drops[0]) if len(drops) else int(np.argmax(f))
+        return (onset, end) if end > onset else None
+
+
+@dataclasses.dataclass(frozen=True, eq=False)
+class PeakPredicted(Detector):
+    """
+    The peak predicted from the samples of the phase so far is known within ``max_sigma`` [N], after at least
+    ``min_samples`` samples since the onset. Used to end the pull of a screening trial early.
+    """
+
+    predictor: PeakPredictor
+    max_sigma: float
+    min_samples: int = 5
+
+    def compile(self) -> Predicate:
+        onset: int | None = None
+
+        def pred(ctx: Any) -> bool:
+            nonlocal onset
+            if onset is None:
+                if ctx.f[-1] <= self.predictor.onset_threshold:
+                    return False
+                onset = len(ctx.f) - 1
+            if len(ctx.f) - onset < self.min_samples:
+                return False
+            p = self.predictor.predict(ctx.t, ctx.f, onset)
+            return p is not None and p.sigma <= self.max_sigma
+
+        return pred
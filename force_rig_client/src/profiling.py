@@ -0,0 +1,162 @@
+from __future__ import annotations
+
+import sys
+import time
+import click
+import pstats
+import cProfile
+import logging
+import threading
+from pathlib import Path
+from collections import Counter
+from types import FrameType
+from typing import Any, Callable, TypeVar
+
+try:
+    import yappi
+except ImportError:  # pragma: no cover
+    yappi = None
+
+_logger = logging.getLogger(__name__)
+
+F = TypeVar("F", bound=Callable[..., Any])
+
+
+class StackSampler:
+    """
+    Periodically samples the stack of one thread from a background thread and counts the collapsed stacks,
+    the input format of flamegraph.pl and speedscope. Unlike a deterministic profiler this sees where the
+    wall-clock time goes, including the time the event loop spends waiting in select(), and the coroutine
+    frames of the running task appear on the stack as regular frames.
+
+    >>> s = StackSampler(interval=1e-3)
+    >>> s.start()
+    >>> def busy():
+    ...     deadline = time.monotonic() + 0.2
+    ...     while time.monotonic() < deadline:
+    ...         pass
+    >>> busy()
+    >>> s.stop()
+    >>> any(stack.endswith("busy") for stack in s.stacks), s.sample_count > 10
+    (True, True)
+    """
+
+    def __init__(self, interval: float = 1e-3, thread: threading.Thread | None = None) -> None:
+        self._interval = interval
+        self._target = (thread or threading.current_thread()).ident
+        self._stop = threading.Event()
+        self._thread = threading.Thread(target=self._run, name="stack_sampler", daemon=True)
+        self.stacks: Counter[str] = Counter()
+
+    @property
+    def sample_count(self) -> int:
+        return sum(self.stacks.values())
+
+    def start(self) -> None:
+        self._thread.start()
+
+    def stop(self) -> None:
+        self._stop.set()
+        self._thread.join()
+
+    def write(self, path: str | Path) -> None:
+        with open(path, "w") as f:
+            for stack, n in self.stacks.most_common():
+                f.write(f"{stack} {n}\n")
+
+    def _run(self) -> None:
+        while not self._stop.wait(self._interval):
+            frame = sys._current_frames().get(self._target)  # pylint: disable=protected-access
+            if frame is not None:
+                self.stacks[self._collapse(frame)] += 1
+
+    @staticmethod
+    def _collapse(frame: FrameType | None) -> str:
+        names = []
+        while frame is not None:
+            code = frame.f_code
+            names.append(f"{Path(code.co_filename).name}:{code.co_firstlineno}:{code.co_name}")
+            frame = frame.f_back
+        return ";".join(reversed(names))
+
+
+class Profiler:
+    """
+    Profiles the whole process until stopped and writes two files:
+
+    - ``PREFIX.pstats`` -- the function statistics, to be opened with ``python -m pstats``, snakeviz, etc.
+      Yappi with the wall clock is used if installed, because it attributes the time to the coroutines correctly
+      across suspensions; otherwise cProfile with the wall clock, which charges the awaited time to the
+      event loop internals.
+    - ``PREFIX.collapsed`` -- the sampled collapsed stacks for a flamegraph (see :class:`StackSampler`).
+
+    >>> import tempfile
+    >>> tmp = tempfile.TemporaryDirectory()
+    >>> p = Profiler(Path(tmp.name) / "run")
+    >>> p.start()
+    >>> sum(range(100_000))
+    4999950000
+    >>> paths = p.stop()
+    >>> [x.name for x in paths]
+    ['run.pstats', 'run.collapsed']
+    >>> pstats.Stats(str(paths[0])).total_calls > 0
+    True
+    >>> tmp.cleanup()
+    """
+
+    def __init__(self, prefix: str | Path) -> None:
+        self._prefix = Path(prefix)
+        self._sampler = StackSampler()
+        self._cprofile: cProfile.Profile | None = None
+
+    def start(self) -> None:
+        if yappi is not None:
+            yappi.set_clock_type("wall")
+            yappi.start(builtins=False)
+        else:
+            self._cprofile = cProfile.Profile(time.perf_counter)
+            self._cprofile.enable()
+        self._sampler.start()
+
+    def stop(self) -> tuple[Path, Path]:
+        """Stops profiling and returns the paths of the written files."""
+        self._sampler.stop()
+        pstats_path = self._prefix.with_name(self._prefix.name + ".pstats")
+        collapsed_path = self._prefix.with_name(self._prefix.name + ".collapsed")
+        if self._cprofile is not None:
+            self._cprofile.disable()
+            self._cprofile.dump_stats(pstats_path)
+        else:
+            yappi.stop()
+            yappi.get_func_stats().save(str(pstats_path), type="pstat")
+            yappi.clear_stats()
+        self._sampler.write(collapsed_path)
+        return pstats_path, collapsed_path
+
+
+def profile_option(f: F) -> F:
+    """
+    Adds the ``--profile PREFIX`` option to a click group: the whole invocation of the command is profiled
+    and the results are written on exit (including exit on error or interrupt), see :class:`Profiler`.
+    """
+
+    def callback(ctx: click.Context, _param: click.Parameter, value: Path | None) -> None:
+        if value is None:
+            return
+        profiler = Profiler(value)
+        profiler.start()
+
+        def finish() -> None:
+            for path in profiler.stop():
+                _logger.warning("Profile written into %s", path.resolve())
+
+        ctx.call_on_close(finish)
+
+    return click.option(
+        "--profile",
+        type=click.Path(dir_okay=False, writable=True, path_type=Path),
+        metavar="PREFIX",
+        expose_value=False,
+        callback=callback,
+        help="Profile the command and write PREFIX.pstats and PREFIX.collapsed (flamegraph stacks) on exit",
+    )(f)
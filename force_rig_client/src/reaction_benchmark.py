@@ -0,0 +1,324 @@
+from __future__ import annotations
+
+import os
+import sys
+import time
+import click
+import serial
+import random
+import asyncio
+import logging
+import itertools
+import threading
+import dataclasses
+
+from typing import Literal
+
+from serial_interface import Packet, IOManager
+from frame_generator import FrameGenerator, MemoryPort, FORCE_FRAME_SIZE, STEPPER_FRAME_SIZE
+from force_rig import ForceRig
+from latency_profile import LatencyHistogram
+from trial_protocol import TrialProtocol, MoveUntil, ForceAbove, RigState
+
+_logger = logging.getLogger(__name__)
+
+Transport = Literal["memory", "pty"]
+Confirm = Literal["echo", "ack"]
+
+
+class _Link:
+    """The device end of a port; the client opens :attr:`port` as if it were the real device."""
+
+    def __init__(self, transport: Transport) -> None:
+        self._master: int | None = None
+        self.port: MemoryPort | serial.Serial
+        if transport == "memory":
+            self.port = MemoryPort()
+        else:
+            self._master, slave = os.openpty()
+            os.set_blocking(self._master, False)
+            self.port = serial.Serial(os.ttyname(slave), timeout=0)
+            os.close(slave)
+
+    def send(self, data: bytes) -> None:
+        if self._master is None:
+            assert isinstance(self.port, MemoryPort)
+            self.port.feed(data)
+        else:
+            os.write(self._master, data)  # The frames are small, the PTY buffer will not fill up.
+
+    def receive(self) -> bytes:
+        if self._master is None:
+            assert isinstance(self.port, MemoryPort)
+            return self.port.take_written()
+        try:
+            return os.read(self._master, 4096)
+        except BlockingIOError:
+            return b""
+
+    def close(self) -> None:
+        self.port.close()
+        if self._master is not None:
+            os.close(self._master)
+
+
+class SimulatedDevices:
+    """
+    The force sensor digitizer and the step drive on the device side of two ports, run by one thread.
+    The digitizer streams the readings back to back at the link rate; each is sampled when its transmission starts
+    and is delivered when it ends. The drive applies each command once it has been received in full
+    (plus ``drive_latency``) and reports the step it is executing every ``report_period``, also subject to the
+    transmission time. All times are time.monotonic().
+
+    A force step can be injected at a known delay after the drive has started moving up;
+    the times the drive applied each command are recorded in :attr:`commands`.
+
+    >>> dev = SimulatedDevices(report_period=0.05)
+    >>> dev.start()
+    >>> dev.drive_link.port.write(Packet(memoryview((-1).to_bytes(4, "little", signed=True))).compile())
+    14
+    >>> dev.inject_after_up(5.0, 0.1)
+    >>> time.sleep(0.3)
+    >>> dev.stop()
+    >>> [step for _, step in dev.commands], round(dev.step_at - dev.commands[0][0], 6)
+    ([-1], 0.1)
+    >>> len(dev.force_link.port.readall()) // FORCE_FRAME_SIZE > 5
+    True
+    """
+
+    def __init__(
+        self,
+        transport: Transport = "memory",
+        baud: float = IOManager.BAUD,
+        report_period: float = 0.1,
+        drive_latency: float = 0.0,
+    ) -> None:
+        self.force_link = _Link(transport)
+        self.drive_link = _Link(transport)
+        self._frame_time = FORCE_FRAME_SIZE * 10 / baud
+        self._command_time = STEPPER_FRAME_SIZE * 10 / baud
+        self._report_period = report_period
+        self._drive_latency = drive_latency
+        self._gen = FrameGenerator()
+        self._lock = threading.Lock()
+        self._stop = threading.Event()
+        self._thread = threading.Thread(target=self._run, name="simulated_devices", daemon=True)
+        self._step = 0
+        self._inject: tuple[float, float] | None = None
+        self._force = 0.0
+        self.step_at: float | None = None
+        """When the injected force step has happened, or None if it has not (yet)."""
+        self.commands: list[tuple[float, int]] = []
+        """(time applied, step) of every command the drive has received."""
+
+    def start(self) -> None:
+        self._thread.start()
+
+    def stop(self) -> None:
+        self._stop.set()
+        self._thread.join()
+        self.force_link.close()
+        self.drive_link.close()
+
+    def inject_after_up(self, force: float, delay: float) -> None:
+        """The force jumps from zero to ``force`` [N] ``delay`` seconds after the drive next applies an up command."""
+        with self._lock:
+            self._inject = force, delay
+            self._force, self.step_at = 0.0, None
+
+    def stop_after(self, t: float) -> float | None:
+        """When the drive first applied a stop command at or after ``t``, if it has."""
+        with self._lock:
+            return next((at for at, step in self.commands if step == 0 and at >= t), None)
+
+    def _run(self) -> None:
+        rx: bytes | memoryview = b""
+        tx: list[tuple[float, bytes]] = []  # Drive reports and when their transmission ends.
+        applying: list[tuple[float, int]] = []  # Commands and when the drive acts on them.
+        frame: bytes | None = None
+        next_sample = next_report = time.monotonic()
+        while not self._stop.is_set():
+            now = time.monotonic()
+            if now >= next_sample:
+                if frame is not None:
+                    self.force_link.send(frame)
+                with self._lock:
+                    force = self._force if self.step_at is not None and next_sample >= self.step_at else 0.0
+                frame = self._gen.force_frame(force)
+                next_sample += self._frame_time
+            rx = b"".join((rx, self.drive_link.receive()))
+            while True:
+                rx, pkt = Packet.parse(rx)
+                if pkt is None:
+                    break
+                step = int.from_bytes(pkt.payload[:4], "little", signed=True)
+                applying.append((now + self._command_time + self._drive_latency, step))
+            while applying and applying[0][0] <= now:
+                at, step = applying.pop(0)
+                self._apply(at, step)
+            if now >= next_report:
+                tx.append((now + self._command_time, self._gen.stepper_frame(self._step)))
+                next_report += self._report_period
+            while tx and tx[0][0] <= now:
+                self.drive_link.send(tx.pop(0)[1])
+            time.sleep(2e-4)
+
+    def _apply(self, at: float, step: int) -> None:
+        self._step = step
+        with self._lock:
+            self.commands.append((at, step))
+            if step == -1 and self._inject is not None:
+                (self._force, delay), self._inject = self._inject, None
+                self.step_at = at + delay
+
+
+@dataclasses.dataclass(frozen=True)
+class ClientConfig:
+    event_driven: bool
+    confirm: Confirm
+
+    def __str__(self) -> str:
+        return f"{'event' if self.event_driven else 'polling'}/{self.confirm}"
+
+
+ALL_CONFIGS = tuple(ClientConfig(e, c) for e, c in itertools.product((False, True), ("echo", "ack")))
+
+
+@dataclasses.dataclass
+class ReactionReport:
+    """
+    The latencies from the force crossing, in nanoseconds:
+
+    - detection: until the runner has seen a sample above the threshold;
+    - stop: until the drive has applied the stop command, i.e., the motor has actually stopped;
+    - confirmed: until the client has the stop confirmed and would proceed with the next phase.
+    """
+
+    config: ClientConfig
+    histograms: dict[str, LatencyHistogram] = dataclasses.field(
+        default_factory=lambda: {s: LatencyHistogram() for s in ReactionReport.STAGES}
+    )
+    missed: int = 0
+    """Trials in which the crossing was not detected, e.g., because the pull had ended by other means."""
+
+    STAGES = ("detection", "stop", "confirmed")
+
+    def report(self) -> str:
+        lines = [
+            f"{str(self.config):<22}{'count':>9}"
+            + "".join(f"{c:>13}" for c in ("p50 [ms]", "p90 [ms]", "p99 [ms]", "max [ms]"))
+        ]
+        for name, h in self.histograms.items():
+            vals = [h.percentile(50), h.percentile(90), h.percentile(99), h.max]
+            lines.append(f"  {name:<20}{h.count:>9}" + "".join(f"{v * 1e-6:>13.3f}" for v in vals))
+        if self.missed:
+            lines.append(f"  missed {self.missed}")
+        return "\n".join(lines)
+
+
+async def run_reaction_benchmark(
+    config: ClientConfig,
+    trials: int,
+    transport: Transport = "memory",
+    threshold: float = 2.0,
+    step_force: float = 5.0,
+    lead: float = 0.5,
+    report_period: float = 0.1,
+    drive_latency: float = 0.0,
+    seed: int | None = 0,
+) -> ReactionReport:
+    """
+    Runs the real client stack (ForceRig under a ProtocolRunner that pulls up until the force exceeds ``threshold``)
+    against the simulated devices. In each trial, the force steps to ``step_force`` at a random moment between
+    ``lead`` and ``lead`` plus a second after the drive has started moving up, and the latencies are measured from it.
+    The lead should exceed the time the client takes to confirm the up command, or the step may fall into it.
+
+    >>> r = asyncio.run(run_reaction_benchmark(ClientConfig(True, "ack"), trials=3, lead=0.2, report_period=0.02))
+    >>> [h.count for h in r.histograms.values()], r.missed
+    ([3, 3, 3], 0)
+    >>> det, stop, confirmed = r.histograms.values()
+    >>> det.min > 0, det.max <= stop.max <= confirmed.max
+    (True, True)
+    """
+    rng = random.Random(seed)
+    dev = SimulatedDevices(transport, report_period=report_period, drive_latency=drive_latency)
+    rig = ForceRig(
+        dev.drive_link.port,  # type: ignore[arg-type]
+        dev.force_link.port,  # type: ignore[arg-type]
+        event_driven=config.event_driven,
+        confirm=config.confirm,
+    )
+    runner = TrialProtocol((MoveUntil("up", ForceAbove(threshold)),), guard_top=False).compile()
+    out = ReactionReport(config)
+    dev.start()
+    try:
+        await rig.setup()
+        for _ in range(trials):
+            dev.inject_after_up(step_force, lead + rng.random())
+            detected_at: float | None = None
+
+            def progress(index: int, f: float) -> None:
+                nonlocal detected_at
+                if detected_at is None and f > threshold:
+                    detected_at = time.monotonic()
+
+            # The protocol has no magnet phases.
+            await runner.run(rig, rig, [], RigState(), progress=progress)  # type: ignore[arg-type]
+            confirmed_at = time.monotonic()
+            step_at = dev.step_at
+            stopped_at = dev.stop_after(step_at) if step_at is not None else None
+            if step_at is None or detected_at is None or stopped_at is None:
+                out.missed += 1
+                continue
+            for stage, at in zip(ReactionReport.STAGES, (detected_at, stopped_at, confirmed_at)):
+                out.histograms[stage].record(int((at - step_at) * 1e9))
+    finally:
+        await rig.close()
+        dev.stop()
+    return out
+
+
+@click.command()
+@click.option("--trials", "-n", default=30, show_default=True, help="Force steps per client configuration")
+@click.option("--io", "io_modes", type=click.Choice(["polling", "event"]), multiple=True, help="Default: both")
+@click.option("--confirm", "confirms", type=click.Choice(["echo", "ack"]), multiple=True, help="Default: both")
+@click.option("--transport", type=click.Choice(["memory", "pty"]), default="pty", show_default=True)
+@click.option("--lead", default=2.5, show_default=True, help="Minimum seconds from the start of the pull to the step")
+@click.option("--report-period", default=0.1, show_default=True, help="Seconds between the step drive reports")
+@click.option("--drive-latency", default=0.0, show_default=True, help="Seconds for the drive to act on a command")
+def cli(
+    trials: int,
+    io_modes: tuple[str, ...],
+    confirms: tuple[Confirm, ...],
+    transport: Transport,
+    lead: float,
+    report_period: float,
+    drive_latency: float,
+) -> None:
+    """
+    Measure the time from a force crossing to the motor stopping, per client I/O configuration,
+    using simulated devices.
+    """
+    configs = [
+        c
+        for c in ALL_CONFIGS
+        if (not io_modes or ("event" if c.event_driven else "polling") in io_modes)
+        and (not confirms or c.confirm in confirms)
+    ]
+    for c in configs:
+        r = asyncio.run(
+            run_reaction_benchmark(
+                c,
+                trials,
+                transport,
+                lead=lead,
+                report_period=report_period,
+                drive_latency=drive_latency,
+            )
+        )
+        click.echo(r.report())
+
+
+if __name__ == "__main__":
+    logging.basicConfig(level=logging.WARNING, stream=sys.stderr)
+    cli()
@@ -0,0 +1,201 @@
+from __future__ import annotations
+
+import os
+import sys
+import click
+import ctypes
+import logging
+import functools
+import threading
+import dataclasses
+
+from typing import Any, Callable, TypeVar
+
+from latency_profile import LatencyHistogram
+
+_logger = logging.getLogger(__name__)
+
+F = TypeVar("F", bound=Callable[..., Any])
+
+_MCL_CURRENT = 1
+_MCL_FUTURE = 2
+
+
+@dataclasses.dataclass(frozen=True)
+class RealtimeConfig:
+    """
+    The scheduling of the reader threads of the ports, which stamp and buffer the readings as they arrive.
+    The event loop keeps the default scheduling, see :func:`apply_to_process`.
+    Every setting is optional and applied on a best-effort basis, see :func:`apply_to_thread`.
+    """
+
+    priority: int | None = None
+    """SCHED_FIFO priority (1 to 99); needs root or CAP_SYS_NICE."""
+    cpu: int | None = None
+    """The core to pin the reader threads to. Ideally one the kernel keeps clear of other work (isolcpus)."""
+    lock_memory: bool = False
+    """mlockall() the process so that no page of the buffers is swapped out; needs CAP_IPC_LOCK or a high limit."""
+
+
+@dataclasses.dataclass
+class RealtimeStatus:
+    """What has actually been achieved; the settings that failed are explained in :attr:`notes`."""
+
+    thread: str
+    priority: int | None = None
+    cpu: int | None = None
+    excluded_cpu: int | None = None
+    """The core the thread has been moved off, to leave it to the reader threads."""
+    memory_locked: bool = False
+    notes: list[str] = dataclasses.field(default_factory=list)
+
+    def __str__(self) -> str:
+        parts = [f"SCHED_FIFO {self.priority}" if self.priority is not None else "default scheduling"]
+        if self.cpu is not None:
+            parts.append(f"pinned to CPU {self.cpu}")
+        elif self.excluded_cpu is not None:
+            parts.append(f"kept off CPU {self.excluded_cpu}")
+        else:
+            parts.append("not pinned")
+        if self.memory_locked:
+            parts.append("memory locked")
+        return f"{self.thread}: " + ", ".join(parts) + "".join(f"; {n}" for n in self.notes)
+
+
+def apply_to_thread(config: RealtimeConfig) -> RealtimeStatus:
+    """
+    Applies the priority and the affinity to the calling thread (on Linux, both are per thread).
+    A setting that is not permitted or not supported is skipped with a warning, never raised.
+
+    >>> allowed = os.sched_getaffinity(0)
+    >>> st = apply_to_thread(RealtimeConfig(cpu=min(allowed)))
+    >>> st.cpu == min(allowed), st.notes, os.sched_getaffinity(0) == {min(allowed)}
+    (True, [], True)
+    >>> os.sched_setaffinity(0, allowed)
+    >>> str(apply_to_thread(RealtimeConfig())) == f"{threading.current_thread().name}: default scheduling, not pinned"
+    True
+    """
+    st = RealtimeStatus(thread=threading.current_thread().name)
+    if config.priority is not None:
+        if not hasattr(os, "sched_setscheduler"):
+            st.notes.append("SCHED_FIFO is not supported on this platform")
+        else:
+            try:
+                os.sched_setscheduler(0, os.SCHED_FIFO, os.sched_param(config.priority))
+                st.priority = config.priority
+            except (PermissionError, OSError, ValueError) as ex:
+                st.notes.append(f"SCHED_FIFO {config.priority} not permitted ({ex}); needs root or CAP_SYS_NICE")
+    if config.cpu is not None:
+        if not hasattr(os, "sched_setaffinity"):
+            st.notes.append("CPU pinning is not supported on this platform")
+        else:
+            try:
+                os.sched_setaffinity(0, {config.cpu})
+                st.cpu = config.cpu
+            except (OSError, ValueError) as ex:
+                st.notes.append(f"cannot pin to CPU {config.cpu} ({ex})")
+    for n in st.notes:
+        _logger.warning("%s: %s", st.thread, n)
+    return st
+
+
+def lock_memory() -> tuple[bool, str | None]:
+    """
+    Locks the pages of the process in RAM. The future allocations are locked too only if the lock limit cannot be
+    hit, because past the limit they would fail. Returns whether it worked and, if not, why.
+    """
+    if not sys.platform.startswith("linux"):
+        return False, "mlockall is only used on Linux"
+    import resource  # pylint: disable=import-outside-toplevel
+
+    soft, _ = resource.getrlimit(resource.RLIMIT_MEMLOCK)
+    unlimited = soft == resource.RLIM_INFINITY or os.geteuid() == 0
+    libc = ctypes.CDLL(None, use_errno=True)
+    if libc.mlockall(_MCL_CURRENT | (_MCL_FUTURE if unlimited else 0)) != 0:
+        err = ctypes.get_errno()
+        return False, f"mlockall failed ({os.strerror(err)}); needs CAP_IPC_LOCK or a higher RLIMIT_MEMLOCK"
+    if not unlimited:
+        return True, "only the current pages are locked because RLIMIT_MEMLOCK is finite"
+    return True, None
+
+
+def apply_to_process(config: RealtimeConfig) -> RealtimeStatus:
+    """
+    The part of the configuration for the event loop, to be invoked from its thread: locks the memory if requested,
+    and moves the thread off the core of the reader threads, so that the analysis it runs (model fitting, plotting)
+    does not take the core from them. The thread keeps the default scheduling: it is busy for long stretches,
+    and the threads it starts (e.g., those of the libraries) would inherit SCHED_FIFO and starve the readers.
+    The reader threads started later get their own settings (see :class:`serial_interface.IOManager`).
+
+    >>> allowed = os.sched_getaffinity(0)
+    >>> st = apply_to_process(RealtimeConfig(priority=50, cpu=max(allowed)))
+    >>> st.priority, os.sched_getaffinity(0) == (allowed - {max(allowed)} or allowed)
+    (None, True)
+    >>> os.sched_setaffinity(0, allowed)
+    """
+    st = RealtimeStatus(thread=threading.current_thread().name)
+    if config.cpu is not None and hasattr(os, "sched_getaffinity"):
+        others = os.sched_getaffinity(0) - {config.cpu}
+        if others:  # With a single core, there is nowhere else to go.
+            try:
+                os.sched_setaffinity(0, others)
+                st.excluded_cpu = config.cpu
+            except (OSError, ValueError) as ex:
+                st.notes.append(f"cannot move off CPU {config.cpu} ({ex})")
+                _logger.warning("%s: %s", st.thread, st.notes[-1])
+    if config.lock_memory:
+        st.memory_locked, note = lock_memory()
+        if note:
+            _logger.warning("%s", note)
+            st.notes.append(note)
+    return st
+
+
+def jitter_report(intervals: LatencyHistogram) -> str:
+    """
+    The spread of the intervals between the arrivals of consecutive readings [ns]. The digitizer paces the readings,
+    so their intervals would be equal but for the host; the jitter is their 99th percentile minus the median.
+
+    >>> h = LatencyHistogram()
+    >>> for v in [100_000_000] * 95 + [110_000_000] * 5:
+    ...     h.record(v)
+    >>> jitter_report(h)
+    'Reading arrival interval over 100 readings: p50 100.0 ms, jitter (p99 - p50) 10.0 ms, max 110.0 ms'
+    """
+    if not intervals.count:
+        return "Reading arrival interval: no consecutive readings"
+    p50, p99 = intervals.percentile(50), intervals.percentile(99)
+    return (
+        f"Reading arrival interval over {intervals.count} readings: p50 {p50 * 1e-6:.1f} ms, "
+        f"jitter (p99 - p50) {(p99 - p50) * 1e-6:.1f} ms, max {intervals.max * 1e-6:.1f} ms"
+    )
+
+
+def realtime_option(f: F) -> F:
+    """
+    Adds the ``--rt-priority``, ``--rt-cpu``, and ``--rt-lock-memory`` options to a click command and passes them
+    as the ``realtime`` argument: a :class:`RealtimeConfig`, or None if none of them is given.
+    """
+
+    @click.option(
+        "--rt-priority",
+        type=click.IntRange(1, 99),
+        metavar="PRIO",
+        help="Run the serial reader threads with SCHED_FIFO at this priority (needs root or CAP_SYS_NICE)",
+    )
+    @click.option(
+        "--rt-cpu",
+        type=int,
+        metavar="CPU",
+        help="Pin the serial reader threads to this core and keep the rest of the client off it",
+    )
+    @click.option("--rt-lock-memory", is_flag=True, help="mlockall() the process (needs CAP_IPC_LOCK)")
+    @functools.wraps(f)
+    def wrapper(*args: Any, rt_priority: int | None, rt_cpu: int | None, rt_lock_memory: bool, **kwargs: Any) -> Any:
+        if rt_priority is None and rt_cpu is None and not rt_lock_memory:
+            kwargs["realtime"] = None
+        else:
+            kwargs["realtime"] = RealtimeConfig(priority=rt_priority, cpu=rt_cpu, lock_memory=rt_lock_memory)
+        return f(*args, **kwargs)
+
+    return wrapper  # type: ignore
@@ -0,0 +1,212 @@
+from __future__ import annotations
+
+import bisect
+import logging
+import threading
+import http.server
+from typing import Callable, Iterable, Sequence, Self
+
+_logger = logging.getLogger(__name__)
+
+
+class _Metric:
+    TYPE = ""
+
+    def __init__(self, name: str, doc: str, labels: Sequence[str] = ()) -> None:
+        self.name = name
+        self.doc = doc
+        self.label_names = tuple(labels)
+        self._children: dict[tuple[str, ...], Self] = {}
+
+    def labels(self, *values: str) -> Self:
+        """Returns the child for the label values. Keep the returned object to avoid the lookup on the hot path."""
+        if len(values) != len(self.label_names):
+            raise ValueError(f"{self.name} expects labels {self.label_names}, got {values}")
+        try:
+            return self._children[values]
+        except KeyError:
+            child = self._children[values] = self._make_child()
+            return child
+
+    def _make_child(self) -> Self:
+        return type(self)(self.name, self.doc)
+
+    def render(self) -> Iterable[str]:
+        yield f"# HELP {self.name} {self.doc}"
+        yield f"# TYPE {self.name} {self.TYPE}"
+        if self.label_names:
+            for values, child in sorted(self._children.items()):
+                lbl = ",".join(f'{k}="{v}"' for k, v in zip(self.label_names, values))
+                yield from child._samples(lbl)
+        else:
+            yield from self._samples("")
+
+    def _samples(self, lbl: str) -> Iterable[str]:
+        raise NotImplementedError
+
+    @staticmethod
+    def _braces(lbl: str) -> str:
+        return f"{{{lbl}}}" if lbl else ""
+
+
+class Counter(_Metric):
+    TYPE = "counter"
+
+    def __init__(self, name: str, doc: str, labels: Sequence[str] = ()) -> None:
+        super().__init__(name, doc, labels)
+        self.value = 0.0
+
+    def inc(self, amount: float = 1.0) -> None:
+        self.value += amount
+
+    def _samples(self, lbl: str) -> Iterable[str]:
+        yield f"{self.name}{self._braces(lbl)} {self.value!r}"
+
+
+class Gauge(_Metric):
+    TYPE = "gauge"
+
+    def __init__(self, name: str, doc: str, labels: Sequence[str] = ()) -> None:
+        super().__init__(name, doc, labels)
+        self.value = 0.0
+
+    def set(self, value: float) -> None:
+        self.value = value
+
+    def _samples(self, lbl: str) -> Iterable[str]:
+        yield f"{self.name}{self._braces(lbl)} {self.value!r}"
+
+
+class Histogram(_Metric):
+    TYPE = "histogram"
+
+    DEFAULT_BUCKETS = (0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0, 2.5, 5.0, 10.0, 30.0, 60.0)
+
+    def __init__(
+        self,
+        name: str,
+        doc: str,
+        labels: Sequence[str] = (),
+        buckets: Sequence[float] = DEFAULT_BUCKETS,
+    ) -> None:
+        super().__init__(name, doc, labels)
+        self.buckets = tuple(sorted(buckets))
+        self.counts = [0] * (len(self.buckets) + 1)
+        self.sum = 0.0
+
+    def _make_child(self) -> Self:
+        return type(self)(self.name, self.doc, buckets=self.buckets)
+
+    def observe(self, value: float) -> None:
+        self.counts[bisect.bisect_left(self.buckets, value)] += 1
+        self.sum += value
+
+    def _samples(self, lbl: str) -> Iterable[str]:
+        sep = "," if lbl else ""
+        acc = 0
+        for le, n in zip(self.buckets, self.counts):
+            acc += n
+            yield f'{self.name}_bucket{{{lbl}{sep}le="{le!r}"}} {acc}'
+        acc += self.counts[-1]
+        yield f'{self.name}_bucket{{{lbl}{sep}le="+Inf"}} {acc}'
+        yield f"{self.name}_sum{self._braces(lbl)} {self.sum!r}"
+        yield f"{self.name}_count{self._braces(lbl)} {acc}"
+
+
+class Registry:
+    """
+    A minimal collection of Prometheus-style metrics.
+    Updating a metric is a plain attribute update or a bisect, so it is cheap enough for the hot paths;
+    the exposition text is only built when the endpoint is scraped.
+
+    >>> reg = Registry()
+    >>> c = reg.counter("fmr_packets_total", "Packets parsed", ["device"])
+    >>> c.labels("force").inc()
+    >>> h = reg.histogram("fmr_command_latency_seconds", "Command latency", buckets=[0.1, 1])
+    >>> h.observe(0.05); h.observe(0.5); h.observe(3)
+    >>> reg.gauge("fmr_best_force_newtons", "Best force").set(1.5)
+    >>> print(reg.render())  # doctest: +NORMALIZE_WHITESPACE
+    # HELP fmr_packets_total Packets parsed
+    # TYPE fmr_packets_total counter
+    fmr_packets_total{device="force"} 1.0
+    # HELP fmr_command_latency_seconds Command latency
+    # TYPE fmr_command_latency_seconds histogram
+    fmr_command_latency_seconds_bucket{le="0.1"} 1
+    fmr_command_latency_seconds_bucket{le="1"} 2
+    fmr_command_latency_seconds_bucket{le="+Inf"} 3
+    fmr_command_latency_seconds_sum 3.55
+    fmr_command_latency_seconds_count 3
+    # HELP fmr_best_force_newtons Best force
+    # TYPE fmr_best_force_newtons gauge
+    fmr_best_force_newtons 1.5
+    >>> reg.counter("fmr_packets_total", "Packets parsed", ["device"]) is c  # Re-registration returns the same.
+    True
+    """
+
+    def __init__(self) -> None:
+        self._metrics: dict[str, _Metric] = {}
+        self._lock = threading.Lock()
+
+    def counter(self, name: str, doc: str, labels: Sequence[str] = ()) -> Counter:
+        out = self._register(name, lambda: Counter(name, doc, labels))
+        assert isinstance(out, Counter), f"{name} is registered as {type(out).__name__}"
+        return out
+
+    def gauge(self, name: str, doc: str, labels: Sequence[str] = ()) -> Gauge:
+        out = self._register(name, lambda: Gauge(name, doc, labels))
+        assert isinstance(out, Gauge), f"{name} is registered as {type(out).__name__}"
+        return out
+
+    def histogram(
+        self,
+        name: str,
+        doc: str,
+        labels: Sequence[str] = (),
+        buckets: Sequence[float] = Histogram.DEFAULT_BUCKETS,
+    ) -> Histogram:
+        out = self._register(name, lambda: Histogram(name, doc, labels, buckets))
+        assert isinstance(out, Histogram), f"{name} is registered as {type(out).__name__}"
+        return out
+
+    def render(self) -> str:
+        with self._lock:
+            metrics = list(self._metrics.values())
+        return "\n".join(line for m in metrics for line in m.render()) + "\n"
+
+    def _register(self, name: str, factory: Callable[[], _Metric]) -> _Metric:
+        with self._lock:
+            if name not in self._metrics:
+                self._metrics[name] = factory()
+            return self._metrics[name]
+
+
+REGISTRY = Registry()
+"""The process-wide registry that all layers report into."""
+
+
+def serve(port: int, host: str = "127.0.0.1", registry: Registry = REGISTRY) -> http.server.ThreadingHTTPServer:
+    """
+    Starts the Prometheus text endpoint at http://host:port/metrics in a daemon thread.
+    The server does not depend on the event loop, so it stays responsive while the loop is blocked
+    (e.g., while the optimizer is fitting its model).
+    """
+
+    class Handler(http.server.BaseHTTPRequestHandler):
+        def do_GET(self) -> None:  # pylint: disable=invalid-name
+            if self.path.split("?")[0] not in ("/metrics", "/"):
+                self.send_error(404)
+                return
+            body = registry.render().encode()
+            self.send_response(200)
+            self.send_header("Content-Type", "text/plain; version=0.0.4; charset=utf-8")
+            self.send_header("Content-Length", str(len(body)))
+            self.end_headers()
+            self.wfile.write(body)
+
+        def log_message(self, format: str, *args: object) -> None:
+            _logger.debug("%s: " + format, self.address_string(), *args)
+
+    server = http.server.ThreadingHTTPServer((host, port), Handler)
+    threading.Thread(target=server.serve_forever, name="metrics", daemon=True).start()
+    _logger.info("Metrics are served at http://%s:%d/metrics", host, server.server_address[1])
+    return server
@@ -0,0 +1,153 @@
+from __future__ import annotations
+
+import random
+import logging
+from typing import Callable, Sequence
+
+_logger = logging.getLogger(__name__)
+
+
+class SimClock:
+    """
+    Virtual time for the simulated rig, so that a trial that takes minutes on the hardware runs in milliseconds.
+    Has the same interface as :class:`trial_protocol.RealClock`.
+    """
+
+    def __init__(self) -> None:
+        self.t = 0.0
+
+    def now(self) -> float:
+        return self.t
+
+    async def sleep(self, seconds: float) -> None:
+        self.t += max(0.0, seconds)
+
+
+def default_residual(values: Sequence[int]) -> float:
+    """A made-up response of the residual holding force [N] to the demag vector, with the optimum at zero."""
+    return 1.0 + 0.002 * sum(abs(v) for v in values[25:])
+
+
+class SimulatedRig:
+    """
+    A kinematic model of the rig with the same interface as :class:`force_rig.ForceRig` and the FluxGrip
+    configuration, for exercising the trial protocols and the optimizer without the hardware.
+
+    The arm position is measured in seconds of travel from the top, downwards positive, like the session does it.
+    Below the contact position the arm presses the plate onto the magnet; above it the wire pulls the plate.
+    A demagnetized magnet holds the plate with the residual force given by ``residual(demag_values)``;
+    the plate detaches when the wire tension exceeds it, and reattaches on the next contact.
+
+    >>> import asyncio
+    >>> rig = SimulatedRig(contact=3.0)
+    >>> async def probe():
+    ...     await rig.configure_demag_values([0] * 51)
+    ...     await rig.move_arm_down()
+    ...     await rig.clock.sleep(3.5)
+    ...     pressed = await rig.get_instant_force()
+    ...     await rig.magnetize(); await rig.demagnetize()
+    ...     await rig.move_arm_up()
+    ...     await rig.clock.sleep(0.6)
+    ...     pulling = await rig.get_instant_force()
+    ...     await rig.clock.sleep(0.5)
+    ...     return pressed, pulling, await rig.get_instant_force()
+    >>> [round(x, 2) for x in asyncio.run(probe())]
+    [-2.75, 0.5, 0.0]
+    """
+
+    def __init__(
+        self,
+        contact: float = 3.0,
+        press_stiffness: float = 5.0,
+        wire_stiffness: float = 5.0,
+        sample_period: float = 0.05,
+        command_latency: float = 0.0,
+        noise: float = 0.0,
+        residual: Callable[[Sequence[int]], float] = default_residual,
+        seed: int | None = 0,
+    ) -> None:
+        """
+        The stiffnesses are in N per second of arm travel. ``sample_period`` is the time each force sample takes;
+        ``command_latency`` is the time each motion command takes to be confirmed (1 s on the real step drive).
+        """
+        self.clock = SimClock()
+        self.contact = contact
+        self._press = press_stiffness
+        self._wire = wire_stiffness
+        self._sample_period = sample_period
+        self._command_latency = command_latency
+        self._noise = noise
+        self._residual_fn = residual
+        self._rng = random.Random(seed)
+        self._position = 0.0
+        self._direction = 0
+        self._updated_at = 0.0
+        self._residual = 0.0
+        self._holding = 0.0
+        self._attached = False
+        self.samples = 0
+        self.commands = 0
+
+    @property
+    def position(self) -> float:
+        self._advance()
+        return self._position
+
+    # ForceRig interface
+
+    async def move_arm_down(self) -> None:
+        await self._command(+1)
+
+    async def move_arm_up(self) -> None:
+        await self._command(-1)
+
+    async def stop_arm(self) -> None:
+        await self._command(0)
+
+    async def calibrate_zero(self) -> None:
+        pass
+
+    async def get_instant_force(self) -> float:
+        await self.clock.sleep(self._sample_period)
+        self._advance()
+        self.samples += 1
+        return self._force() + (self._rng.gauss(0, self._noise) if self._noise > 0 else 0.0)
+
+    def mark_decided(self) -> None:
+        pass
+
+    # FluxGrip interface
+
+    async def configure_demag_values(self, values: Sequence[int]) -> None:
+        self._residual = self._residual_fn(values)
+
+    async def magnetize(self) -> None:
+        self._holding = float("inf")
+
+    async def demagnetize(self) -> None:
+        self._holding = self._residual
+
+    # Internals
+
+    async def _command(self, direction: int) -> None:
+        self._advance()
+        self.commands += 1
+        await self.clock.sleep(self._command_latency)
+        self._advance()
+        self._direction = direction
+
+    def _advance(self) -> None:
+        now = self.clock.now()
+        self._position += self._direction * (now - self._updated_at)
+        self._updated_at = now
+        if self._position >= self.contact:
+            self._attached = True
+        elif self._attached and self._wire * (self.contact - self._position) > self._holding:
+            self._attached = False
+
+    def _force(self) -> float:
+        if self._position >= self.contact:
+            return -self._press * (self._position - self.contact)
+        if self._attached:
+            return self._wire * (self.contact - self._position)
+        return 0.0
@@ -1,14 +1,30 @@
 from __future__ import annotations
 
+import time
 import asyncio
 import serial
 import struct
 import logging
 import dataclasses
 import concurrent.futures
+from pathlib import Path
+from flight_recorder import RECORDER, EventCode
+from rig_metrics import REGISTRY, Histogram
+from realtime import RealtimeConfig, RealtimeStatus, apply_to_thread
 
 _logger = logging.getLogger(__name__)
 
+_M_PACKETS = REGISTRY.counter("fmr_packets_total", "Packets received with a valid CRC", ["device"])
+_M_CRC_ERRORS = REGISTRY.counter("fmr_crc_errors_total", "Packets dropped due to a CRC mismatch")
+_M_RX_BYTES = REGISTRY.counter("fmr_rx_bytes_total", "Bytes read from the serial port", ["device"])
+_M_RECONNECTS = REGISTRY.counter("fmr_reconnects_total", "Serial port reconnections", ["device"])
+_M_DRAIN_LATENCY = REGISTRY.histogram(
+    "fmr_write_drain_latency_seconds",
+    "From frame submission until the coalesced write",
+    ["device"],
+    buckets=[1e-5, 1e-4, 1e-3, 1e-2, 1e-1, 1.0],
+)
+
 
 @dataclasses.dataclass(frozen=True)
 class Packet:
@@ -23,7 +39,8 @@ class Packet:
     _MAGIC_INT = 0xF2EC4CB4
     _MAGIC_BYTES = _MAGIC_INT.to_bytes(4, "little")
     _HEADER_FORMAT = struct.Struct(r"< L B 3x")
-    _CRC_SIZE = 2
+    _CRC_FORMAT = struct.Struct(r"> H")
+    _CRC_SIZE = _CRC_FORMAT.size
 
     @staticmethod
     def parse(data: memoryview | bytes | bytearray) -> tuple[memoryview, Packet | None]:
@@ -63,6 +80,10 @@ class Packet:
         >>> assert rem == b'123'
         >>> assert pkt is not None
         >>> assert pkt.payload == b'123456789'
+        >>>
+        >>> rem, pkt = Packet.parse(valid_packet[:6] + valid_packet)  # Truncated within the header.
+        >>> assert pkt is not None
+        >>> assert pkt.payload == b'123456789'
         """
         data = memoryview(data)
         magic_size = len(Packet._MAGIC_BYTES)
@@ -75,13 +96,16 @@ class Packet:
             assert magic == Packet._MAGIC_INT
             if len(data) < Packet._HEADER_FORMAT.size + payload_size + Packet._CRC_SIZE:
                 return data, None  # Need more data, will continue later.
-            data = data[Packet._HEADER_FORMAT.size :]  # Skip the header. We won't need it anymore.
-            if not CRC16CCITTFalse.new(data[: payload_size + Packet._CRC_SIZE]).check_residue():
+            body = data[Packet._HEADER_FORMAT.size :]
+            if not CRC16CCITTFalse.new(body[: payload_size + Packet._CRC_SIZE]).check_residue():
+                RECORDER.record(EventCode.PACKET_CRC_ERROR, payload_size)
+                _M_CRC_ERRORS.inc()
+                # The header may belong to a truncated frame with the next frame starting right after the magic.
+                data = data[magic_size:]
                 continue
-            payload, data = data[:payload_size], data[payload_size + Packet._CRC_SIZE :]
-            pkt = Packet(payload)
-            _logger.debug("Parsed %s, remainder %d bytes", pkt, len(data))
-            return data, pkt
+            payload, data = body[:payload_size], body[payload_size + Packet._CRC_SIZE :]
+            RECORDER.record(EventCode.PACKET_PARSED, payload_size, len(data))
+            return data, Packet(payload)
         return data, None
 
     def compile(self) -> bytes:
@@ -93,15 +117,33 @@ class Packet:
         >>> Packet(memoryview(b"123456789")).compile().hex()
         'b44cecf20900000031323334353637383929b1'
         """
-        if len(self.payload) > self.MAX_PAYLOAD_SIZE:
-            raise ValueError(f"Payload too large: {len(self.payload)} > {self.MAX_PAYLOAD_SIZE} bytes")
-        return b"".join(
-            (
-                Packet._HEADER_FORMAT.pack(Packet._MAGIC_INT, len(self.payload)),
-                self.payload,
-                CRC16CCITTFalse.new(self.payload).value_as_bytes,
-            )
-        )
+        buf = bytearray(self.compiled_size)
+        self.compile_into(buf, 0)
+        return bytes(buf)
+
+    @property
+    def compiled_size(self) -> int:
+        return Packet._HEADER_FORMAT.size + len(self.payload) + Packet._CRC_SIZE
+
+    def compile_into(self, buffer: bytearray | memoryview, offset: int) -> int:
+        r"""
+        Compiles the packet into the buffer at the specified offset without intermediate allocations.
+        Returns the number of bytes written, which equals :attr:`compiled_size`.
+
+        >>> buf = bytearray(b"-" * 24)
+        >>> Packet(memoryview(b"123456789")).compile_into(buf, 2)
+        19
+        >>> bytes(buf)
+        b'--\xb4L\xec\xf2\t\x00\x00\x00123456789)\xb1---'
+        """
+        size = len(self.payload)
+        if size > self.MAX_PAYLOAD_SIZE:
+            raise ValueError(f"Payload too large: {size} > {self.MAX_PAYLOAD_SIZE} bytes")
+        Packet._HEADER_FORMAT.pack_into(buffer, offset, Packet._MAGIC_INT, size)
+        offset += Packet._HEADER_FORMAT.size
+        buffer[offset : offset + size] = self.payload
+        Packet._CRC_FORMAT.pack_into(buffer, offset + size, CRC16CCITTFalse.new(self.payload).value)
+        return Packet._HEADER_FORMAT.size + size + Packet._CRC_SIZE
 
 
 class CRC16CCITTFalse:
@@ -182,32 +224,306 @@ class CRC16CCITTFalse:
     # fmt: on
 
 
+class WriteQueue:
+    """
+    Collects the frames submitted during one event loop iteration in a preallocated buffer
+    and sends them to the port with a single write from the event loop thread.
+    Each submission returns a future that completes when the frame has been handed over to the OS.
+
+    >>> class Port:
+    ...     def __init__(self): self.writes = []
+    ...     def write(self, data): self.writes.append(bytes(data)); return len(data)
+    >>> port = Port()
+    >>> async def test():
+    ...     wq = WriteQueue(port)
+    ...     await asyncio.gather(*(wq.submit(x) for x in (b"a", b"bc", b"")))
+    ...     return wq
+    >>> wq = asyncio.run(test())
+    >>> len(port.writes)
+    1
+    >>> port.writes[0] == b"".join(Packet(memoryview(x)).compile() for x in (b"a", b"bc", b""))
+    True
+    >>> wq.drain_count, wq.last_drain_latency >= 0
+    (1, True)
+    """
+
+    DEFAULT_CAPACITY = 4096
+
+    def __init__(
+        self,
+        port: serial.Serial,
+        capacity: int = DEFAULT_CAPACITY,
+        latency_metric: Histogram | None = None,
+    ) -> None:
+        if capacity < Packet.MAX_PAYLOAD_SIZE + Packet._HEADER_FORMAT.size + Packet._CRC_SIZE:
+            raise ValueError(f"Write queue capacity too small: {capacity}")
+        self._port = port
+        self._buffer = bytearray(capacity)
+        self._size = 0
+        self._waiters: list[asyncio.Future[None]] = []
+        self._oldest_at: float | None = None
+        self._drain_count = 0
+        self._last_drain_latency = 0.0
+        self._max_drain_latency = 0.0
+        self._latency_metric = latency_metric
+
+    @property
+    def drain_count(self) -> int:
+        """Number of writes issued to the port."""
+        return self._drain_count
+
+    @property
+    def last_drain_latency(self) -> float:
+        """Seconds from the submission of the oldest frame in the last batch until the batch was written."""
+        return self._last_drain_latency
+
+    @property
+    def max_drain_latency(self) -> float:
+        return self._max_drain_latency
+
+    def submit(self, payload: bytes | bytearray | memoryview) -> asyncio.Future[None]:
+        pkt = Packet(memoryview(payload))
+        loop = asyncio.get_running_loop()
+        if self._size + pkt.compiled_size > len(self._buffer):
+            self._drain()
+        self._size += pkt.compile_into(self._buffer, self._size)
+        if self._oldest_at is None:
+            self._oldest_at = loop.time()
+            loop.call_soon(self._drain)
+        fut: asyncio.Future[None] = loop.create_future()
+        self._waiters.append(fut)
+        return fut
+
+    def _drain(self) -> None:
+        if self._oldest_at is None:
+            return  # Already drained because the buffer overflowed.
+        size, waiters = self._size, self._waiters
+        data = memoryview(self._buffer)[:size]
+        oldest_at = self._oldest_at
+        self._waiters, self._oldest_at = [], None
+        try:
+            self._port.write(data)
+        except (serial.SerialException, OSError) as ex:
+            for fut in waiters:
+                if not fut.done():
+                    fut.set_exception(ex)
+        else:
+            for fut in waiters:
+                if not fut.done():
+                    fut.set_result(None)
+        finally:
+            data.release()
+            self._size = 0
+        self._drain_count += 1
+        self._last_drain_latency = asyncio.get_running_loop().time() - oldest_at
+        self._max_drain_latency = max(self._max_drain_latency, self._last_drain_latency)
+        RECORDER.record(EventCode.WRITE_DRAINED, size, self._last_drain_latency)
+        if self._latency_metric is not None:
+            self._latency_metric.observe(self._last_drain_latency)
+
+
 class IOManager:
+    """
+    Owns the serial port of one device and turns the raw byte stream into packets.
+
+    If the port is lost (e.g., the USB adapter re-enumerates after a glitch), the manager reopens the device
+    via its stable /dev/serial/by-id path, invokes :meth:`_reapply_configuration` to let the subclass reapply its
+    configuration, and raises the discontinuity flag that the subclass attaches to the next item it produces.
+
+    >>> port = serial.serial_for_url("loop://")
+    >>> iom = IOManager(port)
+    >>> iom.stable_path is None  # URL ports cannot be reopened by path.
+    True
+    >>> _ = port.write(Packet(memoryview(b"abc")).compile())
+    >>> bytes(asyncio.run(iom._once()).payload)
+    b'abc'
+    >>> iom.close()
+    """
+
     BAUD = 38400
+    RECONNECT_TIMEOUT = 30.0
+    """How long to keep trying to reopen a lost port before giving up and raising."""
 
-    def __init__(self, serial_port: serial.Serial) -> None:
+    EVENT_WAIT = 0.02
+    """How long an event-driven read blocks waiting for the first byte before the caller gets to check its deadline."""
+
+    _RECONNECT_INTERVAL = 0.5
+    _BY_ID_DIR = Path("/dev/serial/by-id")
+
+    def __init__(
+        self,
+        serial_port: serial.Serial,
+        event_driven: bool = False,
+        realtime: RealtimeConfig | None = None,
+    ) -> None:
+        """
+        By default, the port is polled every millisecond. With ``event_driven``, the reader thread blocks on the port
+        until the first byte arrives instead, which wakes the consumer as soon as the data is there.
+        With ``realtime``, the reader thread runs with that scheduling (see :mod:`realtime`); what it has achieved
+        is in :attr:`realtime_status` once the first read has been made.
+        """
         self._port = serial_port
+        self._event_driven = event_driven
         if not self._port.is_open:
             self._port.open()
-        self._executor = concurrent.futures.ThreadPoolExecutor(max_workers=1)
+        self.realtime_status: RealtimeStatus | None = None
+        self._executor = concurrent.futures.ThreadPoolExecutor(
+            max_workers=1,
+            thread_name_prefix=type(self).__name__,
+            initializer=self._init_reader if realtime is not None else None,
+            initargs=(realtime,),
+        )
         self._backlog: bytes | memoryview = b""
+        device = type(self).__name__
+        self._m_packets = _M_PACKETS.labels(device)
+        self._m_rx_bytes = _M_RX_BYTES.labels(device)
+        self._m_reconnects = _M_RECONNECTS.labels(device)
+        self._write_queue = WriteQueue(self._port, latency_metric=_M_DRAIN_LATENCY.labels(device))
+        self._stable_path = self._find_stable_path(self._port.port)
+        self._discontinuity = False
+        self._reconnect_count = 0
+        self._polled_at = time.perf_counter_ns()
+        self._rx_window = self._polled_at, self._polled_at
+
+    @property
+    def stable_path(self) -> str | None:
+        """The /dev/serial/by-id path the port will be reopened by, or None if reconnection is not possible."""
+        return self._stable_path
+
+    @property
+    def reconnect_count(self) -> int:
+        return self._reconnect_count
+
+    @property
+    def write_queue(self) -> WriteQueue:
+        return self._write_queue
+
+    async def send(self, payload: bytes | bytearray | memoryview) -> None:
+        """
+        Sends the payload as one packet. Payloads sent concurrently are coalesced into one write.
+        Raises serial.SerialException if the port is lost.
+        """
+        await self._write_queue.submit(payload)
 
     def close(self) -> None:
         self._port.close()
 
     async def flush(self) -> None:
-        await self._once()
+        await self._once(wait=False)
         self._backlog = b""
 
-    async def _once(self) -> Packet | None:
-        self._port.timeout = 0
-        self._backlog = b"".join(
-            (self._backlog, await asyncio.get_event_loop().run_in_executor(self._executor, self._port.readall))
-        )
+    async def reconnect(self) -> None:
+        """
+        Closes the port and reopens it by the stable path, retrying until :attr:`RECONNECT_TIMEOUT` expires.
+        Raises serial.SerialException if the device could not be reopened.
+        """
+        if self._stable_path is None:
+            raise serial.SerialException(f"{self}: port lost and no stable path is known to reopen it")
+        loop = asyncio.get_running_loop()
+        deadline = loop.time() + self.RECONNECT_TIMEOUT
+        _logger.warning("%s: Port lost, reopening via %s", self, self._stable_path)
+        while True:
+            try:
+                self._port.close()
+                self._port.port = self._stable_path
+                self._port.open()
+                break
+            except (serial.SerialException, OSError) as ex:
+                if loop.time() > deadline:
+                    raise serial.SerialException(f"{self}: could not reopen {self._stable_path}: {ex}") from ex
+                _logger.debug("%s: Reopen failed, will retry: %s", self, ex)
+                await asyncio.sleep(self._RECONNECT_INTERVAL)
+        self._backlog = b""
+        self._discontinuity = True
+        self._reconnect_count += 1
+        RECORDER.record(EventCode.RECONNECT, self._reconnect_count)
+        self._m_reconnects.inc()
+        await self._reapply_configuration()
+        _logger.warning("%s: Reconnected (%d reconnections so far)", self, self._reconnect_count)
+
+    async def _reapply_configuration(self) -> None:
+        """
+        Invoked after the port has been reopened or the device is found to have restarted.
+        Subclasses override this to reapply the device configuration.
+        """
+
+    def _take_discontinuity(self) -> bool:
+        """Returns True once after each reconnection or device restart; the caller marks its next item with it."""
+        out, self._discontinuity = self._discontinuity, False
+        return out
+
+    async def _idle(self) -> None:
+        """Invoked by the read loops of the subclasses when :meth:`_once` has returned nothing."""
+        if not self._event_driven:
+            await asyncio.sleep(1e-3)  # This is silly but works for the MVP.
+
+    def _init_reader(self, realtime: RealtimeConfig) -> None:
+        self.realtime_status = apply_to_thread(realtime)
+
+    def _read_when_ready(self) -> bytes:
+        self._port.timeout = self.EVENT_WAIT
+        head = self._port.read(1)
+        return head + self._port.read(self._port.in_waiting) if head else head
+
+    async def _once(self, wait: bool = True) -> Packet | None:
+        if self._event_driven and wait:
+            # Do not block on the port while a whole packet is already buffered.
+            self._backlog, pkt = Packet.parse(self._backlog)
+            if pkt is not None:
+                self._m_packets.inc()
+                return pkt
+            read = self._read_when_ready
+        else:
+            self._port.timeout = 0
+            read = self._port.readall
+
+        def stamped() -> tuple[bytes, int, int]:
+            # Stamped in the reader thread, so that the stamps do not depend on how busy the event loop is.
+            polled_at = time.perf_counter_ns()
+            chunk = read()
+            return chunk, polled_at, time.perf_counter_ns()
+
+        try:
+            chunk, polled_at, received_at = await asyncio.get_event_loop().run_in_executor(self._executor, stamped)
+        except (serial.SerialException, OSError) as ex:
+            _logger.warning("%s: Read failed: %s: %s", self, type(ex).__name__, ex)
+            await self.reconnect()
+            return None
+        if chunk:  # The new bytes have arrived into the OS buffer some time after the previous poll.
+            self._rx_window = self._polled_at, received_at
+        self._polled_at = polled_at
+        self._m_rx_bytes.inc(len(chunk))
+        self._backlog = b"".join((self._backlog, chunk))
         self._backlog, pkt = Packet.parse(self._backlog)
-        if _logger.isEnabledFor(logging.DEBUG):
-            _logger.debug("%s: Parsed %s, remainder:\n%s", self, pkt, self._backlog.hex())
+        if pkt is not None:
+            self._m_packets.inc()
         return pkt
 
+    @classmethod
+    def _find_stable_path(cls, port_name: str | None) -> str | None:
+        """
+        Finds the /dev/serial/by-id symlink that points to the specified device, unless the name is already stable.
+        The by-id name is derived from the USB serial number, so it survives re-enumeration under a different ttyUSBx.
+
+        >>> IOManager._find_stable_path("loop://") is None
+        True
+        >>> IOManager._find_stable_path(None) is None
+        True
+        """
+        if not port_name or "://" in port_name:
+            return None
+        path = Path(port_name)
+        if path.parent == cls._BY_ID_DIR:
+            return str(path)
+        try:
+            target = path.resolve()
+            for link in sorted(cls._BY_ID_DIR.iterdir()):
+                if link.resolve() == target:
+                    return str(link)
+        except OSError:
+            pass
+        _logger.info("No stable by-id path found for %s; will try to reopen it by the same name", port_name)
+        return str(path)
+
     def __repr__(self) -> str:
         return f"{type(self).__name__}(serial_port={self._port})"
@@ -8,7 +8,10 @@ from typing import Any, Callable, Coroutine
 from serial_interface import IOManager
 from shutil import get_terminal_size
 from step_drive_control import StepDriveControl
+from jog import HELP, JogState, run_jog, terminal_keys
 from client_utils import inform, coroutine
+import flight_recorder
+from profiling import profile_option
 
 logging.basicConfig(level=logging.WARNING, format="%(asctime)s %(process)07d %(levelname)-3.3s %(name)s: %(message)s")
 _logger = logging.getLogger(__name__)
@@ -21,6 +24,7 @@ _logger = logging.getLogger(__name__)
     },
 )
 @click.option("--verbose", "-v", count=True, help="Emit verbose log messages. Specify twice for extra verbosity.")
+@profile_option
 def cli(verbose: int) -> None:
     log_level = {
         0: logging.WARNING,
@@ -28,6 +32,7 @@ def cli(verbose: int) -> None:
         2: logging.DEBUG,
     }.get(verbose or 0, logging.DEBUG)
     logging.root.setLevel(log_level)
+    flight_recorder.dump_on_signal()
 
 
 port_option = click.option(
@@ -48,15 +53,16 @@ port_option = click.option(
 
 @cli.command()
 @port_option
-@click.option("--duration", "-d", default=1, show_default=True, help="Timeout until the motor stops running")
+@click.option("--duration", "-d", default=1.0, show_default=True, help="Seconds until the motor stops running")
 @coroutine
-async def up(port: serial.Serial, duration: int) -> None:
+async def up(port: serial.Serial, duration: float) -> None:
     """
     This command is used to move the arm in the upwards direction.
     """
     if not duration > 0:
         raise click.BadParameter("must be positive", param_hint="duration")
-    step_drive_control = StepDriveControl(port)
+    # The ack confirmation returns as soon as the drive reports the new step, so the duration is what it moves.
+    step_drive_control = StepDriveControl(port, event_driven=True, confirm="ack")
     _logger.info(f"Moving upwards for {duration} seconds")
     await step_drive_control.up()
     await asyncio.sleep(duration)
@@ -66,15 +72,15 @@ async def up(port: serial.Serial, duration: int) -> None:
 
 @cli.command()
 @port_option
-@click.option("--duration", "-d", default=1, show_default=True, help="Timeout until the motor stops running")
+@click.option("--duration", "-d", default=1.0, show_default=True, help="Seconds until the motor stops running")
 @coroutine
-async def down(port: serial.Serial, duration: int) -> None:
+async def down(port: serial.Serial, duration: float) -> None:
     """
     This command is used to move the arm in the downwards direction.
     """
     if not duration > 0:
         raise click.BadParameter("must be positive", param_hint="duration")
-    step_drive_control = StepDriveControl(port)
+    step_drive_control = StepDriveControl(port, event_driven=True, confirm="ack")
     _logger.info(f"Moving downwards for {duration} seconds")
     await step_drive_control.down()
     await asyncio.sleep(duration)
@@ -82,6 +88,35 @@ async def down(port: serial.Serial, duration: int) -> None:
     step_drive_control.close()
 
 
+@cli.command()
+@port_option
+@click.option(
+    "--repeat-delay",
+    default=0.5,
+    show_default=True,
+    help="Seconds a single key press moves the arm; set to the auto-repeat delay of the terminal",
+)
+@coroutine
+async def jog(port: serial.Serial, repeat_delay: float) -> None:
+    """
+    Move the arm interactively while a key is held, with a live readout of the position
+    (seconds of travel from the start, downwards positive).
+    """
+    step_drive_control = StepDriveControl(port, event_driven=True, confirm="ack")
+    inform(HELP)
+    try:
+        async with terminal_keys() as keys:
+            state = await run_jog(
+                step_drive_control,
+                keys,
+                show=lambda s: inform(f"\r{s}", nl=False),
+                state=JogState(first_hold=repeat_delay),
+            )
+    finally:
+        step_drive_control.close()
+    inform(f"\nEnded {state.position:+.3f} s from the start")
+
+
 def main() -> None:
     status: Any = 1
     try:
@@ -102,9 +137,11 @@ def main() -> None:
     except Exception as ex:  # pylint: disable=broad-except
         inform(f"Error (run with -v for more info): {type(ex).__name__}: {ex}", fg="red")
         _logger.info("Error: %s: %s", type(ex).__name__, ex, exc_info=True)
+        flight_recorder.RECORDER.dump(flight_recorder.DEFAULT_DUMP_PATH)
     except BaseException as ex:  # pylint: disable=broad-except
         inform(f"Internal error, please report: {ex}", fg="red")
         _logger.exception("%s: %s", type(ex).__name__, ex)
+        flight_recorder.RECORDER.dump(flight_recorder.DEFAULT_DUMP_PATH)
     _logger.debug("EXIT %r", status)
     sys.exit(status)
 
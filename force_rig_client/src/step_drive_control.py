@@ -4,12 +4,23 @@ import asyncio
 import dataclasses
 import logging
 import struct
+import serial
 import numpy as np
 
-from serial_interface import IOManager, Packet
+from typing import Literal
+
+from serial_interface import IOManager
+from realtime import RealtimeConfig
+from flight_recorder import RECORDER, EventCode
+from rig_metrics import REGISTRY
 
 _logger = logging.getLogger(__name__)
 
+_M_COMMAND_LATENCY = REGISTRY.histogram(
+    "fmr_drive_command_latency_seconds", "From the first attempt to the confirmation of a drive command", ["command"]
+)
+_M_COMMAND_RETRIES = REGISTRY.counter("fmr_drive_command_retries_total", "Drive commands that had to be resent")
+
 
 @dataclasses.dataclass(frozen=True)
 class StepDriveCommand:
@@ -47,6 +58,24 @@ class StepDriveControl(IOManager):
     _STRUCT_COMMAND = struct.Struct(r"< i")
     _DIRECTION_TO_STEP = {"UP": np.int32(-1), "STOP": np.int32(0), "DOWN": np.int32(1)}
 
+    ACK_TIMEOUT = 1.0
+
+    def __init__(
+        self,
+        port: serial.Serial,
+        event_driven: bool = False,
+        confirm: Literal["echo", "ack"] = "echo",
+        realtime: RealtimeConfig | None = None,
+    ) -> None:
+        """
+        The driver reports the step it is executing continuously. With ``confirm="echo"``, a command is confirmed
+        by the first report that arrives after a second has passed, which leaves the driver ample time to act on it.
+        With ``confirm="ack"``, it is confirmed by the first report of the new step, however soon that arrives.
+        """
+        super().__init__(port, event_driven, realtime)
+        self._confirm = confirm
+        self._last_command = self._DIRECTION_TO_STEP["STOP"]
+
     @staticmethod
     def step_to_direction(step: np.int32) -> str:
         if step == -1:
@@ -67,28 +96,95 @@ class StepDriveControl(IOManager):
                 return StepDriveCommand(step=np.int32(step))
             if deadline < asyncio.get_event_loop().time():
                 return None
-            await asyncio.sleep(1e-3)
+            await self._idle()
+
+    async def _write_command(self, command: np.int32) -> bool:
+        self._last_command = command
+        RECORDER.record(EventCode.COMMAND_SENT, int(command))
+        try:
+            await self.send(command.astype(np.int32).tobytes())
+        except (serial.SerialException, OSError) as ex:
+            _logger.warning("%s: Write failed: %s: %s", self, type(ex).__name__, ex)
+            await self.reconnect()
+            return False
+        return True
 
     async def _send_command(self, command: np.int32) -> bool:
-        payload = command.astype(np.int32).tobytes()
-        buf = Packet(memoryview(payload)).compile()
-        res = await asyncio.to_thread(self._port.write, buf)
-        assert res is not None
+        if not await self._write_command(command):
+            return False  # The caller will retry.
+        if self._confirm == "ack":
+            # The reports buffered before the command may still show the old step; skip them.
+            deadline = asyncio.get_running_loop().time() + self.ACK_TIMEOUT
+            while (rd := await self.fetch(timeout=deadline - asyncio.get_running_loop().time())) is not None:
+                if rd.step == command:
+                    return True
+            return False
         await asyncio.sleep(1.0)
         await self.flush()
         rd = await self.fetch(timeout=1)
         return rd is not None and (rd.step == command)
 
+    async def _reapply_configuration(self) -> None:
+        """
+        Stops the drive after a reconnection. A motion is never resumed on its own after a link fault:
+        the driver may have gone on executing the last step while the link was down, so it is stopped,
+        and what to do next is left to the trial logic, which sees :attr:`reconnect_count`.
+
+        The port is lost while the arm is moving down; it is reopened, and the drive is stopped:
+
+        >>> import os, pty, logging
+        >>> from serial_interface import Packet
+        >>> master, slave = pty.openpty()
+        >>> logging.disable(logging.WARNING)
+        >>> port = serial.Serial(os.ttyname(slave))
+        >>> async def test():
+        ...     drive = StepDriveControl(port)
+        ...     await drive.command_unconfirmed("DOWN")
+        ...     port.close()
+        ...     assert await drive.fetch(timeout=0.1) is None
+        ...     drive.close()
+        ...     return drive.reconnect_count, drive._take_discontinuity(), drive._take_discontinuity()
+        >>> asyncio.run(test())
+        (1, True, False)
+        >>> logging.disable(logging.NOTSET)
+        >>> sent, steps = memoryview(os.read(master, 64)), []
+        >>> while (pkt := Packet.parse(sent))[1] is not None:
+        ...     sent, steps = pkt[0], steps + [int.from_bytes(pkt[1].payload, "little", signed=True)]
+        >>> steps
+        [1, 0]
+        >>> os.close(master), os.close(slave)
+        (None, None)
+        """
+        if self._last_command != self._DIRECTION_TO_STEP["STOP"]:
+            _logger.warning(
+                "%s: Stopping the %s in progress after reconnection", self, self.step_to_direction(self._last_command)
+            )
+        self._last_command = self._DIRECTION_TO_STEP["STOP"]
+        RECORDER.record(EventCode.COMMAND_SENT, int(self._last_command))
+        await self.send(self._last_command.astype(np.int32).tobytes())
+
+    async def _command(self, direction: str) -> None:
+        """Sends the command until it is confirmed."""
+        started_at = asyncio.get_running_loop().time()
+        while not await self._send_command(self._DIRECTION_TO_STEP[direction]):
+            _logger.debug("Resending command %s", direction)
+            _M_COMMAND_RETRIES.inc()
+        _M_COMMAND_LATENCY.labels(direction).observe(asyncio.get_running_loop().time() - started_at)
+
+    async def command_unconfirmed(self, direction: str) -> bool:
+        """
+        Sends the command once without waiting for the confirmation, for callers that watch the reports themselves
+        and resend as needed (see :mod:`jog`). Returns False if the write has failed and the port was reconnected.
+        """
+        return await self._write_command(self._DIRECTION_TO_STEP[direction])
+
     async def up(self):
         _logger.debug("ARM IS MOVING UP")
-        while not await self._send_command(self._DIRECTION_TO_STEP["UP"]):
-            _logger.debug("Sending command to pull arm up")
+        await self._command("UP")
 
     async def stop(self):
-        while not await self._send_command(self._DIRECTION_TO_STEP["STOP"]):
-            _logger.debug("Sending command to stop arm")
+        await self._command("STOP")
 
     async def down(self):
         _logger.debug("ARM IS MOVING DOWN")
-        while not await self._send_command(self._DIRECTION_TO_STEP["DOWN"]):
-            _logger.debug("Sending command to pull arm down")
+        await self._command("DOWN")
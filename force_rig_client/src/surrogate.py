@@ -0,0 +1,145 @@
+from __future__ import annotations
+
+import logging
+import warnings
+import numpy as np
+from typing import Any, Sequence
+
+from numpy.typing import ArrayLike, NDArray
+from scipy.linalg import solve_triangular
+from sklearn.base import BaseEstimator, RegressorMixin
+from sklearn.exceptions import ConvergenceWarning
+from sklearn.gaussian_process import GaussianProcessRegressor
+from sklearn.gaussian_process.kernels import ConstantKernel, Matern, WhiteKernel
+
+_logger = logging.getLogger(__name__)
+
+SURROGATES = ("gp", "sparse-gp", "rf", "et", "gbrt")
+"""
+- gp -- the exact GP used by gp_minimize; the fit is cubic in the number of observations.
+- sparse-gp -- :class:`SparseGaussianProcess`; the fit is linear in the number of observations.
+- rf, et, gbrt -- the tree ensembles of skopt (random forest, extra trees, gradient boosted trees).
+"""
+
+
+class SparseGaussianProcess(RegressorMixin, BaseEstimator):
+    """
+    A GP regressor with inducing points (the deterministic training conditional approximation) that stays cheap
+    when the observations pile up. The kernel hyperparameters are fitted by maximizing the exact marginal likelihood
+    on the inducing points only, which is cubic in their number but independent of the number of observations;
+    the posterior then uses all observations at the cost of O(n m^2).
+
+    The inducing points are a random subset of the observations that always includes the best (lowest) quarter,
+    so that the model stays accurate around the incumbent where the acquisition function looks the most.
+    The inputs are standardized internally, so the estimator can work on the raw search space.
+    It is compatible with skopt: ``predict(X, return_std=True)`` and sklearn cloning are supported.
+
+    >>> rng = np.random.default_rng(0)
+    >>> x = rng.uniform(-3, 3, (400, 2))
+    >>> y = np.sin(x[:, 0]) + 0.1 * x[:, 1] ** 2 + rng.normal(0, 0.05, 400)
+    >>> m = SparseGaussianProcess(n_inducing=40, random_state=0).fit(x, y)
+    >>> m.inducing_points_.shape
+    (40, 2)
+    >>> mu, std = m.predict(np.array([[0.5, 1.0], [-2.0, 0.0]]), return_std=True)
+    >>> truth = np.array([np.sin(0.5) + 0.1, np.sin(-2.0)])
+    >>> bool(np.all(np.abs(mu - truth) < 0.1)), bool(np.all(std > 0) and np.all(std < 0.3))
+    (True, True)
+    >>> bool(m.predict(np.array([[30.0, 30.0]]), return_std=True)[1][0] > 0.5)  # Far from the data: uncertain.
+    True
+    """
+
+    def __init__(self, n_inducing: int = 64, n_restarts_optimizer: int = 2, random_state: int | None = None) -> None:
+        self.n_inducing = n_inducing
+        self.n_restarts_optimizer = n_restarts_optimizer
+        self.random_state = random_state
+
+    def fit(self, X: ArrayLike, y: ArrayLike) -> SparseGaussianProcess:
+        x = np.asarray(X, dtype=np.float64)
+        y = np.asarray(y, dtype=np.float64).ravel()
+        self.x_mean_, self.x_scale_ = x.mean(axis=0), x.std(axis=0) + 1e-12
+        self.y_mean_, self.y_scale_ = float(y.mean()), float(y.std()) + 1e-12
+        xs, ys = (x - self.x_mean_) / self.x_scale_, (y - self.y_mean_) / self.y_scale_
+
+        idx = self._select_inducing(ys)
+        kernel = ConstantKernel(1.0, (1e-2, 1e2)) * Matern(
+            length_scale=np.ones(x.shape[1]), length_scale_bounds=(1e-2, 1e2), nu=2.5
+        ) + WhiteKernel(1e-2, (1e-6, 1e1))
+        gpr = GaussianProcessRegressor(
+            kernel, n_restarts_optimizer=self.n_restarts_optimizer, random_state=self.random_state
+        )
+        with warnings.catch_warnings():  # Hitting the length scale bound just means the dimension is irrelevant.
+            warnings.simplefilter("ignore", ConvergenceWarning)
+            gpr.fit(xs[idx], ys[idx])
+        self.kernel_ = gpr.kernel_.k1  # type: ignore
+        self.noise_ = float(gpr.kernel_.k2.noise_level)  # type: ignore
+        self.inducing_points_ = xs[idx]
+
+        u = self.inducing_points_
+        self.l_uu_ = np.linalg.cholesky(self.kernel_(u) + 1e-8 * np.eye(len(u)))
+        # The posterior is expressed via V = L_uu^-1 K_uf and A = I + V V^T / noise, which stays well-conditioned
+        # even if the noise is tiny, unlike K_uu + K_uf K_fu / noise.
+        v = solve_triangular(self.l_uu_, self.kernel_(u, xs), lower=True)
+        self.l_a_ = np.linalg.cholesky(np.eye(len(u)) + v @ v.T / self.noise_)
+        self.beta_ = self._solve(self.l_a_, v @ ys) / self.noise_
+        return self
+
+    def predict(
+        self, X: ArrayLike, return_std: bool = False
+    ) -> NDArray[np.float64] | tuple[NDArray[np.float64], NDArray[np.float64]]:
+        xs = (np.asarray(X, dtype=np.float64) - self.x_mean_) / self.x_scale_
+        a = solve_triangular(self.l_uu_, self.kernel_(self.inducing_points_, xs), lower=True)
+        mean = a.T @ self.beta_ * self.y_scale_ + self.y_mean_
+        if not return_std:
+            return mean
+        # var = K_** - Q_** + K_*u Sigma K_u*; the first two terms restore the prior far from the inducing points.
+        b = solve_triangular(self.l_a_, a, lower=True)
+        var = self.kernel_.diag(xs) - np.sum(a**2, axis=0) + np.sum(b**2, axis=0)
+        return mean, np.sqrt(np.maximum(var, 1e-12)) * self.y_scale_
+
+    def _select_inducing(self, ys: NDArray[np.float64]) -> NDArray[np.intp]:
+        n, m = len(ys), self.n_inducing
+        if n <= m:
+            return np.arange(n)
+        best = np.argsort(ys)[: m // 4]
+        rest = np.setdiff1d(np.arange(n), best)
+        rng = np.random.default_rng(self.random_state)
+        return np.sort(np.concatenate([best, rng.choice(rest, m - len(best), replace=False)]))
+
+    @staticmethod
+    def _solve(l: NDArray[np.float64], b: NDArray[np.float64]) -> NDArray[np.float64]:
+        return solve_triangular(l.T, solve_triangular(l, b, lower=True), lower=False)
+
+
+def make_optimizer(
+    surrogate: str,
+    dimensions: Sequence[Any],
+    random_state: int | None = None,
+    n_initial_points: int = 10,
+) -> Any:
+    """
+    Creates a skopt.Optimizer with the selected surrogate model (see :data:`SURROGATES`) to be driven with ask/tell.
+    The "gp" surrogate is set up exactly like gp_minimize does it.
+    """
+    from skopt import Optimizer
+    from skopt.utils import cook_estimator, normalize_dimensions
+
+    rng = np.random.RandomState(random_state)
+    seed = rng.randint(0, np.iinfo(np.int32).max)
+    base_estimator: Any
+    if surrogate == "gp":
+        dimensions = normalize_dimensions(dimensions)
+        base_estimator = cook_estimator("GP", space=dimensions, random_state=seed, noise="gaussian")
+    elif surrogate == "sparse-gp":
+        base_estimator = SparseGaussianProcess(random_state=seed)
+    elif surrogate in ("rf", "et", "gbrt"):
+        base_estimator = surrogate.upper()
+    else:
+        raise ValueError(f"Unknown surrogate {surrogate!r}, expected one of {SURROGATES}")
+    _logger.info("Surrogate model: %s", base_estimator)
+    return Optimizer(
+        dimensions,
+        base_estimator,
+        n_initial_points=n_initial_points,
+        acq_func="gp_hedge",
+        random_state=rng,
+    )
@@ -0,0 +1,265 @@
+from __future__ import annotations
+
+import json
+import time
+import zlib
+import struct
+import hashlib
+import logging
+import dataclasses
+import numpy as np
+
+from pathlib import Path
+from typing import Any, Mapping, Sequence
+from numpy.typing import ArrayLike, NDArray
+
+try:
+    import zstandard
+except ImportError:  # pragma: no cover
+    zstandard = None
+
+_logger = logging.getLogger(__name__)
+
+
+@dataclasses.dataclass(frozen=True)
+class Trial:
+    """
+    One trial read back from the archive.
+    """
+
+    trial_id: int
+    timestamp: float
+    """Unix time when the trial was archived."""
+    demag_values: list[int]
+    config: dict[str, Any]
+    columns: dict[str, NDArray[np.float64]]
+    peak: float
+    peak_sigma: float
+
+
+class TraceArchive:
+    """
+    An append-only archive of full-rate trial traces, meant to keep years of rig history on a laptop.
+
+    The archive is a directory with two files:
+
+    - ``traces.dat`` -- the compressed trial records, appended one after another. Each column is quantized to
+      a fixed resolution (:attr:`RESOLUTION`), delta-encoded, and the record is compressed with zstd (or zlib if
+      zstandard is not installed). Slowly changing traces like timestamps and forces compress very well this way.
+    - ``index.bin`` -- one fixed-size record per trial: where its data is, when it was taken, the hashes of its
+      demag vector and rig configuration, and its peak force. The index is memory-mapped, so finding trials
+      does not require reading the data file, and reading one trial is a single seek and decompress.
+
+    >>> import tempfile
+    >>> tmp = tempfile.TemporaryDirectory()
+    >>> ar = TraceArchive(tmp.name)
+    >>> t = np.arange(0, 10, 0.1)
+    >>> tid = ar.append({"t": t, "f": np.sin(t)}, [1, -2, 3], {"rate": 10}, peak=1.0, peak_sigma=0.1)
+    >>> _ = ar.append({"t": t, "f": np.cos(t)}, [4, 5, 6], {"rate": 10}, peak=1.0)
+    >>> tid, len(ar)
+    (0, 2)
+    >>> list(ar.find(demag_values=[4, 5, 6])), list(ar.find(config={"rate": 10})), list(ar.find(config={}))
+    ([1], [0, 1], [])
+    >>> tr = ar.read(0)
+    >>> tr.demag_values, tr.config, tr.peak, tr.peak_sigma
+    ([1, -2, 3], {'rate': 10}, 1.0, 0.1)
+    >>> bool(np.allclose(tr.columns["f"], np.sin(t), atol=TraceArchive.RESOLUTION))
+    True
+    >>> list(TraceArchive(tmp.name).find(since=0))  # Reopening sees the same trials.
+    [0, 1]
+    >>> tmp.cleanup()
+    """
+
+    RESOLUTION = 1e-6
+    """Quantization step of all columns: microseconds for time, micronewtons for force."""
+
+    INDEX_DTYPE = np.dtype(
+        [
+            ("offset", "<u8"),
+            ("length", "<u4"),
+            ("codec", "<u1"),
+            ("_reserved", "<u1", (3,)),
+            ("timestamp", "<f8"),
+            ("vector_hash", "<u8"),
+            ("config_hash", "<u8"),
+            ("n_samples", "<u4"),
+            ("_reserved2", "<u4"),
+            ("peak", "<f8"),
+            ("peak_sigma", "<f8"),
+        ]
+    )
+
+    _CODEC_ZLIB = 1
+    _CODEC_ZSTD = 2
+    _META_LENGTH = struct.Struct(r"< L")
+
+    def __init__(self, path: str | Path) -> None:
+        self._path = Path(path)
+        self._path.mkdir(parents=True, exist_ok=True)
+        self._data_path = self._path / "traces.dat"
+        self._index_path = self._path / "index.bin"
+        self._data_path.touch()
+        self._index_path.touch()
+        self._index: NDArray[Any] = np.zeros(0, dtype=self.INDEX_DTYPE)
+        self._remap()
+
+    @property
+    def path(self) -> Path:
+        return self._path
+
+    @property
+    def index(self) -> NDArray[Any]:
+        """The memory-mapped index; the row number is the trial ID."""
+        if self._index_path.stat().st_size // self.INDEX_DTYPE.itemsize != len(self._index):
+            self._remap()  # Another process has appended to the archive.
+        return self._index
+
+    def __len__(self) -> int:
+        return len(self.index)
+
+    @staticmethod
+    def vector_hash(demag_values: Sequence[int]) -> int:
+        return TraceArchive._hash(np.asarray(demag_values, dtype="<i4").tobytes())
+
+    @staticmethod
+    def config_hash(config: Mapping[str, Any]) -> int:
+        return TraceArchive._hash(json.dumps(config, sort_keys=True).encode())
+
+    def append(
+        self,
+        columns: Mapping[str, ArrayLike],
+        demag_values: Sequence[int],
+        config: Mapping[str, Any] | None = None,
+        peak: float = float("nan"),
+        peak_sigma: float = float("nan"),
+        timestamp: float | None = None,
+    ) -> int:
+        """
+        Adds the trial to the archive and returns its ID. All columns must have the same length.
+        """
+        config = dict(config or {})
+        timestamp = time.time() if timestamp is None else timestamp
+        cols = {k: np.asarray(v, dtype=np.float64) for k, v in columns.items()}
+        lengths = {len(v) for v in cols.values()}
+        if len(lengths) > 1:
+            raise ValueError(f"Columns have different lengths: { {k: len(v) for k, v in cols.items()} }")
+        n_samples = lengths.pop() if lengths else 0
+        meta = {
+            "demag_values": [int(x) for x in demag_values],
+            "config": config,
+            "columns": list(cols),
+        }
+        meta_bytes = json.dumps(meta).encode()
+        raw = b"".join(
+            [self._META_LENGTH.pack(len(meta_bytes)), meta_bytes]
+            + [self._encode_column(v).tobytes() for v in cols.values()]
+        )
+        codec, blob = self._compress(raw)
+        with open(self._data_path, "ab") as f:
+            offset = f.tell()
+            f.write(blob)
+        rec = np.zeros(1, dtype=self.INDEX_DTYPE)
+        rec["offset"] = offset
+        rec["length"] = len(blob)
+        rec["codec"] = codec
+        rec["timestamp"] = timestamp
+        rec["vector_hash"] = self.vector_hash(demag_values)
+        rec["config_hash"] = self.config_hash(config)
+        rec["n_samples"] = n_samples
+        rec["peak"] = peak
+        rec["peak_sigma"] = peak_sigma
+        # The index is written last, so a trial is either fully archived or not at all.
+        with open(self._index_path, "ab") as f:
+            trial_id = f.tell() // self.INDEX_DTYPE.itemsize
+            f.write(rec.tobytes())
+        self._remap()
+        _logger.debug("%s: Archived trial %d: %d samples in %d bytes", self, trial_id, n_samples, len(blob))
+        return trial_id
+
+    def read(self, trial_id: int) -> Trial:
+        rec = self.index[trial_id]
+        with open(self._data_path, "rb") as f:
+            f.seek(int(rec["offset"]))
+            raw = self._decompress(int(rec["codec"]), f.read(int(rec["length"])))
+        (meta_len,) = self._META_LENGTH.unpack_from(raw)
+        pos = self._META_LENGTH.size + meta_len
+        meta = json.loads(raw[self._META_LENGTH.size : pos])
+        n = int(rec["n_samples"])
+        columns = {}
+        for name in meta["columns"]:
+            columns[name] = self._decode_column(np.frombuffer(raw, dtype="<i8", count=n, offset=pos))
+            pos += n * 8
+        return Trial(
+            trial_id=trial_id,
+            timestamp=float(rec["timestamp"]),
+            demag_values=meta["demag_values"],
+            config=meta["config"],
+            columns=columns,
+            peak=float(rec["peak"]),
+            peak_sigma=float(rec["peak_sigma"]),
+        )
+
+    def find(
+        self,
+        demag_values: Sequence[int] | None = None,
+        config: Mapping[str, Any] | None = None,
+        since: float | None = None,
+        until: float | None = None,
+    ) -> NDArray[np.int64]:
+        """
+        Returns the IDs of the trials matching all of the specified criteria, in chronological order.
+        The time bounds are Unix timestamps, inclusive.
+        """
+        idx = self.index
+        mask = np.ones(len(idx), dtype=bool)
+        if demag_values is not None:
+            mask &= idx["vector_hash"] == self.vector_hash(demag_values)
+        if config is not None:
+            mask &= idx["config_hash"] == self.config_hash(config)
+        if since is not None:
+            mask &= idx["timestamp"] >= since
+        if until is not None:
+            mask &= idx["timestamp"] <= until
+        return np.flatnonzero(mask)
+
+    def _remap(self) -> None:
+        size = self._index_path.stat().st_size
+        count = size // self.INDEX_DTYPE.itemsize
+        if size % self.INDEX_DTYPE.itemsize:
+            _logger.warning("%s: Index has a partial record at the end, ignoring it", self)
+        if count == 0:
+            self._index = np.zeros(0, dtype=self.INDEX_DTYPE)
+        else:
+            self._index = np.memmap(self._index_path, dtype=self.INDEX_DTYPE, mode="r", shape=(count,))
+
+    @classmethod
+    def _encode_column(cls, values: NDArray[np.float64]) -> NDArray[np.int64]:
+        q = np.round(values / cls.RESOLUTION).astype("<i8")
+        return np.diff(q, prepend=np.int64(0))
+
+    @classmethod
+    def _decode_column(cls, deltas: NDArray[np.int64]) -> NDArray[np.float64]:
+        return np.cumsum(deltas, dtype=np.int64) * cls.RESOLUTION
+
+    @classmethod
+    def _compress(cls, raw: bytes) -> tuple[int, bytes]:
+        if zstandard is not None:
+            return cls._CODEC_ZSTD, zstandard.ZstdCompressor(level=9).compress(raw)
+        return cls._CODEC_ZLIB, zlib.compress(raw, 9)
+
+    @classmethod
+    def _decompress(cls, codec: int, blob: bytes) -> bytes:
+        if codec == cls._CODEC_ZLIB:
+            return zlib.decompress(blob)
+        if codec == cls._CODEC_ZSTD:
+            if zstandard is None:
+                raise RuntimeError("This trial is compressed with zstd; please install zstandard")
+            return bytes(zstandard.ZstdDecompressor().decompress(blob))
+        raise ValueError(f"Unknown codec: {codec}")
+
+    @staticmethod
+    def _hash(data: bytes) -> int:
+        return int.from_bytes(hashlib.blake2b(data, digest_size=8).digest(), "little")
+
+    def __repr__(self) -> str:
+        return f"{type(self).__name__}({str(self._path)!r})"
@@ -0,0 +1,93 @@
+from __future__ import annotations
+
+import logging
+import dataclasses
+import numpy as np
+from typing import Any, Mapping, Sequence
+from numpy.typing import NDArray
+
+from trace_archive import TraceArchive, Trial
+
+_logger = logging.getLogger(__name__)
+
+
+@dataclasses.dataclass(frozen=True)
+class CachedTrials:
+    """
+    Everything known about one demag vector under one rig configuration.
+    """
+
+    trial_ids: list[int]
+    """The completed trials, oldest first."""
+    peaks: NDArray[np.float64]
+    """Peak force of each completed trial [N]."""
+    aborted_ids: list[int]
+    """The trials aborted because the force limit was exceeded."""
+
+    @property
+    def count(self) -> int:
+        return len(self.trial_ids)
+
+    @property
+    def mean(self) -> float:
+        return float(np.mean(self.peaks)) if len(self.peaks) else float("nan")
+
+    @property
+    def std(self) -> float:
+        return float(np.std(self.peaks, ddof=1)) if len(self.peaks) > 1 else float("nan")
+
+
+class TrialCache:
+    """
+    Finds the results of a demag vector measured before under the same rig configuration in the trace archive,
+    so that the optimizer does not spend hardware time on the points it has already evaluated.
+    The archive index is memory-mapped, so a lookup costs a vectorized comparison of two hash columns.
+    The trials archived without a peak (NaN) are the aborted ones.
+
+    >>> import tempfile
+    >>> tmp = tempfile.TemporaryDirectory()
+    >>> ar = TraceArchive(tmp.name)
+    >>> trace = {"t": [0, 1, 2], "f": [0, 3, 0]}
+    >>> _ = ar.append(trace, [1, 2], {"rate": 10}, peak=3.0)
+    >>> _ = ar.append(trace, [1, 2], {"rate": 10}, peak=4.0)
+    >>> _ = ar.append(trace, [1, 2], {"rate": 20}, peak=9.0)
+    >>> _ = ar.append({"t": [0, 1], "f": [0, 16.5]}, [5, 5], {"rate": 10})
+    >>> cache = TrialCache(ar, {"rate": 10})
+    >>> hit = cache.lookup([1, 2])
+    >>> hit.trial_ids, hit.mean, round(hit.std, 3), hit.aborted_ids
+    ([0, 1], 3.5, 0.707, [])
+    >>> hit = cache.lookup([5, 5])
+    >>> hit.count, hit.aborted_ids, cache.aborted_force(hit)
+    (0, [3], 16.5)
+    >>> cache.lookup([7]) is None
+    True
+    >>> tmp.cleanup()
+    """
+
+    def __init__(self, archive: TraceArchive, config: Mapping[str, Any]) -> None:
+        self._archive = archive
+        self._config = dict(config)
+
+    @property
+    def archive(self) -> TraceArchive:
+        return self._archive
+
+    def lookup(self, demag_values: Sequence[int]) -> CachedTrials | None:
+        ids = self._archive.find(demag_values=demag_values, config=self._config)
+        if len(ids) == 0:
+            return None
+        peaks = self._archive.index["peak"][ids]
+        done = ~np.isnan(peaks)
+        return CachedTrials(
+            trial_ids=[int(x) for x in ids[done]],
+            peaks=np.asarray(peaks[done], dtype=np.float64),
+            aborted_ids=[int(x) for x in ids[~done]],
+        )
+
+    def trials(self, hit: CachedTrials) -> list[Trial]:
+        """Reads the traces of the completed trials."""
+        return [self._archive.read(i) for i in hit.trial_ids]
+
+    def aborted_force(self, hit: CachedTrials) -> float:
+        """The largest force reached by the aborted trials, which exceeded the limit."""
+        return max(float(np.max(self._archive.read(i).columns["f"])) for i in hit.aborted_ids)
@@ -0,0 +1,697 @@
+from __future__ import annotations
+
+import time
+import asyncio
+import logging
+import dataclasses
+from collections import deque
+from typing import Callable, Literal, Protocol, Sequence
+
+from force_sensor_interface import MovingAverage
+
+_logger = logging.getLogger(__name__)
+
+Direction = Literal["up", "down"]
+_SIGN = {"up": -1, "down": +1, None: 0}
+
+DETACHED = "Detached"
+"""Reported by the :func:`standard_protocol` when its detachment detector fires."""
+
+
+class ForceLimitExceeded(RuntimeError):
+    """
+    The trial was aborted because the force exceeded the limit of the protocol; the arm is stopped.
+    The result is a constraint violation rather than a measurement of the demag values.
+    """
+
+    def __init__(self, force: float, limit: float, trace: Trace | None = None) -> None:
+        super().__init__(f"Force {force:.1f} N exceeded the limit of {limit:.1f} N")
+        self.force = force
+        self.limit = limit
+        self.trace = trace
+        """What was recorded up to the violation, if the trial has been run."""
+
+
+class TravelLimitExceeded(RuntimeError):
+    """The arm has reached the top while still moving up; it is stopped."""
+
+
+class LinkInterrupted(RuntimeError):
+    """
+    A port of the rig was reopened or a device has restarted during the trial, so the trace has a gap
+    of unknown length and the arm may have stopped in between; the arm is stopped, and the trial should be rerun.
+    """
+
+
+class Rig(Protocol):
+    """The subset of :class:`force_rig.ForceRig` the runner needs."""
+
+    async def move_arm_down(self) -> None:
+        ...
+
+    async def move_arm_up(self) -> None:
+        ...
+
+    async def stop_arm(self) -> None:
+        ...
+
+    async def calibrate_zero(self) -> None:
+        ...
+
+    async def get_instant_force(self) -> float:
+        """Raises :class:`LinkInterrupted` if a link has been interrupted since the last zero calibration."""
+        ...
+
+    def mark_decided(self) -> None:
+        ...
+
+
+class Magnet(Protocol):
+    """The subset of :class:`fluxgrip_config.FluxGripConfig` the runner needs."""
+
+    async def configure_demag_values(self, values: Sequence[int]) -> None:
+        ...
+
+    async def magnetize(self) -> None:
+        ...
+
+    async def demagnetize(self) -> None:
+        ...
+
+
+class Clock(Protocol):
+    def now(self) -> float:
+        ...
+
+    async def sleep(self, seconds: float) -> None:
+        ...
+
+
+class RealClock:
+    def now(self) -> float:
+        return time.monotonic()
+
+    async def sleep(self, seconds: float) -> None:
+        await asyncio.sleep(seconds)
+
+
+@dataclasses.dataclass
+class RigState:
+    """What the runner knows about the rig between trials; it persists across the runs of a session."""
+
+    position: float = 0.0
+    """Arm position in seconds of travel from the top, downwards positive. There is no position sensor."""
+    contact: float | None = None
+    """The position where the plate last touched the magnet, if known."""
+
+
+@dataclasses.dataclass
+class Trace:
+    t: list[float] = dataclasses.field(default_factory=list)
+    f: list[float] = dataclasses.field(default_factory=list)
+
+
+# ----------------------------------------------------------------------------------------------------------------------
+# Detectors. Each is a declarative spec that is compiled into a fresh stateful predicate per phase run.
+
+
+class _Context:
+    """What the predicates see: the samples of the current phase and where the arm is."""
+
+    __slots__ = ("t", "f", "position", "started_at", "state", "report", "announced")
+
+    def __init__(self, started_at: float, state: RigState, report: Callable[[str], None] | None = None) -> None:
+        self.t: list[float] = []
+        self.f: list[float] = []
+        self.position = state.position
+        self.started_at = started_at
+        self.state = state
+        self.report = report or (lambda s: None)
+        self.announced: set[str] = set()
+
+
+Predicate = Callable[[_Context], bool]
+
+
+class Detector:
+    """Base of the detectors; ``a | b`` and ``a & b`` combine them."""
+
+    def compile(self) -> Predicate:
+        raise NotImplementedError
+
+    def __or__(self, other: Detector) -> Detector:
+        return AnyOf((self, other))
+
+    def __and__(self, other: Detector) -> Detector:
+        return AllOf((self, other))
+
+
+@dataclasses.dataclass(frozen=True)
+class ForceBelow(Detector):
+    threshold: float
+
+    def compile(self) -> Predicate:
+        th = self.threshold
+        return lambda ctx: ctx.f[-1] < th
+
+
+@dataclasses.dataclass(frozen=True)
+class ForceAbove(Detector):
+    threshold: float
+
+    def compile(self) -> Predicate:
+        th = self.threshold
+        return lambda ctx: ctx.f[-1] > th
+
+
+@dataclasses.dataclass(frozen=True)
+class ForceDrop(Detector):
+    """The force has dropped by more than ``delta`` [N] over the last ``span`` samples."""
+
+    delta: float
+    span: int = 1
+
+    def compile(self) -> Predicate:
+        d, n = self.delta, self.span
+        return lambda ctx: len(ctx.f) > n + 1 and ctx.f[-1 - n] - ctx.f[-1] > d
+
+
+@dataclasses.dataclass(frozen=True)
+class DropFromPeak(Detector):
+    """Once the force has exceeded ``onset`` [N], it has fallen below ``fraction`` of the peak so far."""
+
+    fraction: float
+    onset: float
+
+    def compile(self) -> Predicate:
+        peak = 0.0
+
+        def pred(ctx: _Context) -> bool:
+            nonlocal peak
+            f = ctx.f[-1]
+            peak = max(peak, f)
+            return peak > self.onset and f < self.fraction * peak
+
+        return pred
+
+
+@dataclasses.dataclass(frozen=True)
+class Plateau(Detector):
+    """Once the force has exceeded ``onset`` [N], the last ``samples`` samples stay within ``band`` [N]."""
+
+    samples: int
+    band: float
+    onset: float
+
+    def compile(self) -> Predicate:
+        window: deque[float] = deque(maxlen=self.samples)
+        started = False
+
+        def pred(ctx: _Context) -> bool:
+            nonlocal started
+            window.append(ctx.f[-1])
+            started = started or ctx.f[-1] > self.onset
+            return started and len(window) == self.samples and max(window) - min(window) < self.band
+
+        return pred
+
+
+@dataclasses.dataclass(frozen=True)
+class Elapsed(Detector):
+    """The phase has been running for ``seconds``."""
+
+    seconds: float
+
+    def compile(self) -> Predicate:
+        return lambda ctx: ctx.t[-1] - ctx.started_at >= self.seconds
+
+
+@dataclasses.dataclass(frozen=True)
+class Latched(Detector):
+    """The detector has fired at any point in this phase."""
+
+    detector: Detector
+
+    def compile(self) -> Predicate:
+        inner = self.detector.compile()
+        fired = False
+
+        def pred(ctx: _Context) -> bool:
+            nonlocal fired
+            fired = inner(ctx) or fired
+            return fired
+
+        return pred
+
+
+@dataclasses.dataclass(frozen=True)
+class After(Detector):
+    """``seconds`` have passed since the detector first fired."""
+
+    detector: Detector
+    seconds: float
+
+    def compile(self) -> Predicate:
+        inner = self.detector.compile()
+        fired_at: float | None = None
+
+        def pred(ctx: _Context) -> bool:
+            nonlocal fired_at
+            if inner(ctx) and fired_at is None:
+                fired_at = ctx.t[-1]
+            return fired_at is not None and ctx.t[-1] - fired_at >= self.seconds
+
+        return pred
+
+
+@dataclasses.dataclass(frozen=True)
+class Smoothed(Detector):
+    """
+    The detector sees the force through a moving average of ``depth`` samples; the trace keeps the raw samples.
+    A drop detector should span the same depth, since the filter spreads a step over that many samples.
+
+    Noise of ±1 N around 1 N followed by a drop to -2 N; the raw drop detector would fire on every other sample:
+
+    >>> pred = Smoothed(ForceDrop(0.5, span=4), depth=4).compile()
+    >>> ctx = _Context(0.0, RigState())
+    >>> for i, f in enumerate([0, 2, 0, 2, 0, 2, 0, 2, -2, -2, -2, -2]):
+    ...     ctx.t.append(i)
+    ...     ctx.f.append(f)
+    ...     if pred(ctx):
+    ...         print("fired at", i)
+    fired at 9
+    fired at 10
+    fired at 11
+    """
+
+    detector: Detector
+    depth: int
+
+    def compile(self) -> Predicate:
+        inner = self.detector.compile()
+        if self.depth <= 1:
+            return inner
+        view: _Context | None = None
+        lpf: MovingAverage[float] | None = None
+
+        def pred(ctx: _Context) -> bool:
+            nonlocal view, lpf
+            if view is None or lpf is None:
+                view, lpf = _Context(ctx.started_at, ctx.state, ctx.report), MovingAverage(self.depth, ctx.f[-1])
+                view.announced = ctx.announced
+            view.t.append(ctx.t[-1])
+            view.f.append(lpf(ctx.f[-1]))
+            view.position = ctx.position
+            return inner(view)
+
+        return pred
+
+
+@dataclasses.dataclass(frozen=True)
+class Announced(Detector):
+    """
+    The detector, which also passes ``event`` to the report callback of the run the first time it fires in the phase,
+    e.g., for the live plot to mark the detachment where the detector has seen it. The event is reported once
+    per phase however many times the spec is used in the phase.
+
+    >>> ctx = _Context(0.0, RigState(), report=print)
+    >>> pred = (Latched(Announced(ForceAbove(1.0), "Over")) | Announced(ForceAbove(1.0), "Over")).compile()
+    >>> for i, f in enumerate([0, 2, 3, 0]):
+    ...     ctx.t.append(i)
+    ...     ctx.f.append(f)
+    ...     _ = pred(ctx)
+    Over
+    """
+
+    detector: Detector
+    event: str
+
+    def compile(self) -> Predicate:
+        inner = self.detector.compile()
+
+        def pred(ctx: _Context) -> bool:
+            fired = inner(ctx)
+            if fired and self.event not in ctx.announced:
+                ctx.announced.add(self.event)
+                ctx.report(self.event)
+            return fired
+
+        return pred
+
+
+@dataclasses.dataclass(frozen=True)
+class AboveContact(Detector):
+    """The arm is at least ``clearance`` [s of travel] above the last contact position."""
+
+    clearance: float
+
+    def compile(self) -> Predicate:
+        return lambda ctx: ctx.state.contact is not None and ctx.position <= ctx.state.contact - self.clearance
+
+
+@dataclasses.dataclass(frozen=True)
+class AnyOf(Detector):
+    detectors: tuple[Detector, ...]
+
+    def compile(self) -> Predicate:
+        preds = [d.compile() for d in self.detectors]
+        # Every predicate is evaluated on every sample: the stateful ones must see the whole phase.
+        return lambda ctx: any([p(ctx) for p in preds])
+
+
+@dataclasses.dataclass(frozen=True)
+class AllOf(Detector):
+    detectors: tuple[Detector, ...]
+
+    def compile(self) -> Predicate:
+        preds = [d.compile() for d in self.detectors]
+        return lambda ctx: all([p(ctx) for p in preds])
+
+
+# ----------------------------------------------------------------------------------------------------------------------
+# Phases.
+
+
+@dataclasses.dataclass(frozen=True)
+class Configure:
+    """Writes the demag values of the trial into the magnet."""
+
+
+@dataclasses.dataclass(frozen=True)
+class Magnetize:
+    settle: float = 0.0
+
+
+@dataclasses.dataclass(frozen=True)
+class Demagnetize:
+    settle: float = 0.0
+
+
+@dataclasses.dataclass(frozen=True)
+class CalibrateZero:
+    """Measures the zero bias of the force sensor; the arm should be stopped and the sensor unloaded."""
+
+
+@dataclasses.dataclass(frozen=True)
+class Wait:
+    seconds: float
+
+
+@dataclasses.dataclass(frozen=True)
+class MoveFor:
+    direction: Direction
+    seconds: float
+    stop: bool = True
+
+
+@dataclasses.dataclass(frozen=True)
+class MoveUntil:
+    """
+    Moves the arm sampling the force until the detector fires.
+    If ``record``, the samples go into the trace of the trial; if ``mark_contact``, the position where the detector
+    fired is stored as the contact position. Without ``stop``, the arm keeps moving into the next phase.
+    """
+
+    direction: Direction
+    until: Detector
+    record: bool = False
+    mark_contact: bool = False
+    stop: bool = True
+    label: str = ""
+
+
+Phase = Configure | Magnetize | Demagnetize | CalibrateZero | Wait | MoveFor | MoveUntil
+
+
+@dataclasses.dataclass(frozen=True)
+class TrialProtocol:
+    """
+    The declarative description of one trial: the phases executed in order and the limits checked on every sample.
+    """
+
+    phases: tuple[Phase, ...]
+    max_force: float | None = None
+    """The arm is stopped and ForceLimitExceeded raised once a sample exceeds this [N]."""
+    guard_top: bool = True
+    """The arm is stopped and TravelLimitExceeded raised if it would move up beyond the top (position 0)."""
+    smoothing: int = 1
+    """Depth of the moving average applied to the force samples."""
+
+    def compile(self) -> ProtocolRunner:
+        return ProtocolRunner(self)
+
+
+def standard_protocol(
+    delta_threshold: float = 0.5,
+    max_force: float = 15.0,
+    touch_force: float = -1.0,
+    press_time: float = 10.0,
+    tail_time: float = 10.0,
+    minimal_lift: bool = False,
+    lift_clearance: float = 1.0,
+    lift_press_time: float = 1.0,
+    early_stop: Detector | None = None,
+    touch_smoothing: int = 1,
+    detach_smoothing: int = 1,
+) -> TrialProtocol:
+    """
+    The trial of the measurement session: descend until the plate touches the magnet (the sensor sees it as a push),
+    press on for ``press_time`` so that the plate lies flat, magnetize and demagnetize, then pull up until
+    ``tail_time`` after the plate has detached (a sample-to-sample drop of ``delta_threshold``). With ``minimal_lift``,
+    the pull ends early once the plate has detached and the arm is ``lift_clearance`` above the contact position,
+    and the press lasts only ``lift_press_time``: the plate hangs just above the magnet, so it only has to be seated,
+    and every second of the press is another second the pull has to travel back before the plate is loaded.
+    The pull also ends if ``early_stop`` fires, e.g., once the peak can be predicted in the screening mode;
+    the plate may then still be attached.
+    The smoothing depths are the moving averages seen by the touch and the detachment detectors
+    (see :mod:`filter_tuning`). The detachment is reported as :data:`DETACHED` when the detector fires.
+
+    The time a repeated trial takes, with the same peak:
+
+    >>> from rig_simulator import SimulatedRig
+    >>> async def repeat(minimal_lift):
+    ...     rig, state = SimulatedRig(contact=6.0, residual=lambda v: float(v[0])), RigState()
+    ...     runner = standard_protocol(press_time=4.0, tail_time=1.0, minimal_lift=minimal_lift).compile()
+    ...     await runner.run(rig, rig, [4] * 51, state, clock=rig.clock)
+    ...     started_at = rig.clock.now()
+    ...     trace = await runner.run(rig, rig, [4] * 51, state, clock=rig.clock)
+    ...     return round(rig.clock.now() - started_at, 1), round(max(trace.f), 2)
+    >>> asyncio.run(repeat(False)), asyncio.run(repeat(True))
+    ((14.2, 3.75), (6.1, 3.75))
+    """
+    touched = Smoothed(ForceBelow(touch_force), touch_smoothing)
+    detached = Announced(Smoothed(ForceDrop(delta_threshold, span=detach_smoothing), detach_smoothing), DETACHED)
+    until: Detector = After(detached, tail_time)
+    if minimal_lift:
+        until = until | (Latched(detached) & AboveContact(lift_clearance))
+        press_time = min(press_time, lift_press_time)
+    if early_stop is not None:
+        until = until | early_stop
+    return TrialProtocol(
+        phases=(
+            Configure(),
+            MoveUntil("down", touched, mark_contact=True, stop=False, label="descent"),
+            MoveFor("down", press_time),
+            Magnetize(settle=1.0),
+            Demagnetize(settle=1.0),
+            MoveUntil("up", until, record=True, label="pull"),
+        ),
+        max_force=max_force,
+    )
+
+
+class ProtocolRunner:
+    """
+    Executes a compiled :class:`TrialProtocol`. The motion commands are only sent on a change of direction,
+    so consecutive phases in the same direction cost no extra round trip to the step drive (about 1 s each),
+    and the timed phases wait without blocking the event loop.
+
+    >>> from rig_simulator import SimulatedRig
+    >>> rig = SimulatedRig(contact=3.0, residual=lambda v: float(v[0]))
+    >>> runner = standard_protocol(press_time=2.0, tail_time=1.0).compile()
+    >>> state = RigState()
+    >>> trace = asyncio.run(runner.run(rig, rig, [4] * 51, state, clock=rig.clock))
+    >>> round(max(trace.f), 2), round(state.contact, 2), round(state.position, 2), rig.commands
+    (3.75, 3.25, 1.2, 4)
+    >>> round(rig.position, 2)
+    1.2
+
+    The limits stop the arm before raising:
+
+    >>> try:
+    ...     asyncio.run(runner.run(rig, rig, [20] * 51, state, clock=rig.clock))
+    ... except ForceLimitExceeded as ex:
+    ...     print(ex, len(ex.trace.f) > 0, rig.position == state.position)
+    Force 15.0 N exceeded the limit of 15.0 N True True
+    >>> guarded = TrialProtocol((MoveUntil("up", ForceAbove(100)),)).compile()
+    >>> asyncio.run(guarded.run(rig, rig, [], RigState(position=0.5), clock=rig.clock))
+    Traceback (most recent call last):
+    ...
+    trial_protocol.TravelLimitExceeded: Top reached
+
+    Protocols are validated when compiled:
+
+    >>> TrialProtocol((MoveUntil("up", AboveContact(1.0)),)).compile()
+    Traceback (most recent call last):
+    ...
+    ValueError: AboveContact is used before any phase marks the contact position
+    """
+
+    def __init__(self, protocol: TrialProtocol) -> None:
+        self._protocol = protocol
+        marked = False
+        for ph in protocol.phases:
+            if isinstance(ph, MoveUntil):
+                if not marked and _uses(ph.until, AboveContact):
+                    raise ValueError("AboveContact is used before any phase marks the contact position")
+                marked = marked or ph.mark_contact
+            elif isinstance(ph, (MoveFor, Wait, Magnetize, Demagnetize)):
+                if getattr(ph, "seconds", 0) < 0 or getattr(ph, "settle", 0) < 0:
+                    raise ValueError(f"Negative duration in {ph}")
+        if protocol.smoothing < 1:
+            raise ValueError("Smoothing depth must be positive")
+
+    @property
+    def protocol(self) -> TrialProtocol:
+        return self._protocol
+
+    async def run(
+        self,
+        rig: Rig,
+        magnet: Magnet,
+        demag_values: Sequence[int],
+        state: RigState,
+        clock: Clock | None = None,
+        report: Callable[[str], None] | None = None,
+        progress: Callable[[int, float], None] | None = None,
+    ) -> Trace:
+        """
+        Runs the trial with the given demag values and returns the recorded trace; ``state`` is updated in place.
+        ``report`` receives the phase transitions, ``progress`` every sample with its index in the phase.
+        On any exception the arm is stopped and the state reflects where it is.
+        """
+        r = _Run(self._protocol, rig, magnet, state, clock or RealClock(), report, progress)
+        try:
+            for ph in self._protocol.phases:
+                await r.execute(ph, demag_values)
+            await r.move(None)
+        except BaseException:
+            await r.move(None)
+            raise
+        return r.trace
+
+
+def _uses(det: Detector, kind: type) -> bool:
+    if isinstance(det, kind):
+        return True
+    if isinstance(det, (AnyOf, AllOf)):
+        return any(_uses(d, kind) for d in det.detectors)
+    if isinstance(det, (Latched, After, Smoothed, Announced)):
+        return _uses(det.detector, kind)
+    return False
+
+
+class _Run:
+    def __init__(
+        self,
+        protocol: TrialProtocol,
+        rig: Rig,
+        magnet: Magnet,
+        state: RigState,
+        clock: Clock,
+        report: Callable[[str], None] | None,
+        progress: Callable[[int, float], None] | None,
+    ) -> None:
+        self.protocol = protocol
+        self.rig = rig
+        self.magnet = magnet
+        self.state = state
+        self.clock = clock
+        self.report = report or (lambda s: None)
+        self.progress = progress
+        self.trace = Trace()
+        self.direction: Direction | None = None
+        self.moved_at = 0.0
+        self.lpf: MovingAverage[float] | None = None
+
+    def position(self, now: float) -> float:
+        return self.state.position + _SIGN[self.direction] * (now - self.moved_at)
+
+    async def move(self, direction: Direction | None) -> None:
+        if direction == self.direction:
+            return
+        started_at = self.clock.now()
+        if direction == "up":
+            await self.rig.move_arm_up()
+        elif direction == "down":
+            await self.rig.move_arm_down()
+        else:
+            await self.rig.stop_arm()
+        # The old motion lasts until the command is confirmed; the new one is counted from when it was sent.
+        self.state.position = self.position(self.clock.now())
+        self.direction = direction
+        self.moved_at = started_at
+
+    async def execute(self, ph: Phase, demag_values: Sequence[int]) -> None:
+        if isinstance(ph, MoveUntil):
+            await self._move_until(ph)
+        elif isinstance(ph, MoveFor):
+            await self.move(ph.direction)
+            await self.clock.sleep(ph.seconds)
+            if ph.stop:
+                await self.move(None)
+        elif isinstance(ph, Configure):
+            await self.magnet.configure_demag_values(demag_values)
+        elif isinstance(ph, Magnetize):
+            self.report("Magnetizing")
+            await self.magnet.magnetize()
+            await self.clock.sleep(ph.settle)
+        elif isinstance(ph, Demagnetize):
+            self.report("Demagnetizing")
+            await self.magnet.demagnetize()
+            await self.clock.sleep(ph.settle)
+        elif isinstance(ph, CalibrateZero):
+            await self.move(None)
+            await self.rig.calibrate_zero()
+            self.lpf = None
+        elif isinstance(ph, Wait):
+            await self.clock.sleep(ph.seconds)
+        else:  # pragma: no cover
+            raise TypeError(f"Unknown phase {ph!r}")
+
+    async def _move_until(self, ph: MoveUntil) -> None:
+        self.report(f"Moving {ph.direction}" + (f" ({ph.label})" if ph.label else ""))
+        await self.move(ph.direction)
+        until = ph.until.compile()
+        ctx = _Context(self.clock.now(), self.state, self.report)
+        max_force, smoothing = self.protocol.max_force, self.protocol.smoothing
+        while True:
+            f = await self.rig.get_instant_force()
+            now = self.clock.now()
+            if smoothing > 1:
+                if self.lpf is None:
+                    self.lpf = MovingAverage(smoothing, f)
+                f = self.lpf(f)
+            ctx.t.append(now)
+            ctx.f.append(f)
+            ctx.position = self.position(now)
+            if ph.record:
+                self.trace.t.append(now)
+                self.trace.f.append(f)
+            if self.progress is not None:
+                self.progress(len(ctx.f) - 1, f)
+            if max_force is not None and f > max_force:
+                await self.move(None)
+                raise ForceLimitExceeded(f, max_force, self.trace)
+            if self.protocol.guard_top and self.direction == "up" and ctx.position <= 0:
+                await self.move(None)
+                raise TravelLimitExceeded("Top reached")
+            done = until(ctx)
+            self.rig.mark_decided()
+            if done:
+                break
+        if ph.mark_contact:
+            self.state.contact = ctx.position
+        self.report(f"Stopped moving {ph.direction}: {ph.until}")
+        if ph.stop:
+            await self.move(None)